@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "pen_aes_batch.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PEN_HAVE_AESNI 1
+#include <immintrin.h>
+#endif
+
+#define PEN_AES_ROUNDS 10
+#define PEN_AES_LANES 8
+
+struct pen_aes_batch_s {
+#ifdef PEN_HAVE_AESNI
+    __m128i enc_[PEN_AES_ROUNDS + 1];
+    __m128i dec_[PEN_AES_ROUNDS + 1];
+#endif
+    pen_crypt_t enkey_;
+    pen_crypt_t dekey_;
+    bool accel_;
+};
+
+#ifdef PEN_HAVE_AESNI
+#define PEN_AESNI __attribute__((target("aes,sse2")))
+
+PEN_AESNI static inline __m128i
+_expand(__m128i key, __m128i gen)
+{
+    gen = _mm_shuffle_epi32(gen, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, gen);
+}
+
+#define _EXPAND(k, i, rcon) \
+    k[i] = _expand(k[i - 1], _mm_aeskeygenassist_si128(k[i - 1], rcon))
+
+PEN_AESNI static void
+_aesni_init(pen_aes_batch_t self, const uint8_t key[16])
+{
+    __m128i *k = self->enc_;
+
+    k[0] = _mm_loadu_si128((const __m128i*)key);
+    _EXPAND(k, 1, 0x01);
+    _EXPAND(k, 2, 0x02);
+    _EXPAND(k, 3, 0x04);
+    _EXPAND(k, 4, 0x08);
+    _EXPAND(k, 5, 0x10);
+    _EXPAND(k, 6, 0x20);
+    _EXPAND(k, 7, 0x40);
+    _EXPAND(k, 8, 0x80);
+    _EXPAND(k, 9, 0x1b);
+    _EXPAND(k, 10, 0x36);
+
+    self->dec_[0] = k[PEN_AES_ROUNDS];
+    for (int i = 1; i < PEN_AES_ROUNDS; i++)
+        self->dec_[i] = _mm_aesimc_si128(k[PEN_AES_ROUNDS - i]);
+    self->dec_[PEN_AES_ROUNDS] = k[0];
+}
+
+/* PEN_AES_LANES independent blocks per round keep the AES unit busy */
+#define _AESNI_BATCH(name, keys, round, last) \
+PEN_AESNI static void \
+name(pen_aes_batch_t self, pen_aes_data_t *data, size_t num) \
+{ \
+    const __m128i *k = self->keys; \
+    __m128i b[PEN_AES_LANES]; \
+    size_t i = 0, n; \
+\
+    while (i < num) { \
+        n = num - i < PEN_AES_LANES ? num - i : PEN_AES_LANES; \
+        for (size_t j = 0; j < n; j++) \
+            b[j] = _mm_xor_si128(_mm_loadu_si128((__m128i*)&data[i + j]), k[0]); \
+        for (int r = 1; r < PEN_AES_ROUNDS; r++) { \
+            for (size_t j = 0; j < n; j++) \
+                b[j] = round(b[j], k[r]); \
+        } \
+        for (size_t j = 0; j < n; j++) \
+            _mm_storeu_si128((__m128i*)&data[i + j], last(b[j], k[PEN_AES_ROUNDS])); \
+        i += n; \
+    } \
+}
+
+_AESNI_BATCH(_aesni_encrypt, enc_, _mm_aesenc_si128, _mm_aesenclast_si128)
+_AESNI_BATCH(_aesni_decrypt, dec_, _mm_aesdec_si128, _mm_aesdeclast_si128)
+
+/* only trust our key schedule if it agrees with pen_crypt */
+static bool
+_aesni_check(pen_aes_batch_t self)
+{
+    pen_aes_data_t ref, out;
+
+    for (int i = 0; i < 16; i++)
+        ref.c_[i] = (uint8_t)(i * 17 + 3);
+    out = ref;
+
+    pen_crypt_aes_encrypt(self->enkey_, &ref);
+    _aesni_encrypt(self, &out, 1);
+    if (memcmp(&ref, &out, sizeof(ref)) != 0)
+        return false;
+    if (self->dekey_ == NULL)
+        return true;
+
+    pen_crypt_aes_decrypt(self->dekey_, &ref);
+    _aesni_decrypt(self, &out, 1);
+    return memcmp(&ref, &out, sizeof(ref)) == 0;
+}
+#endif
+
+pen_aes_batch_t
+pen_aes_batch_init(const char *passwd, pen_crypt_t enkey, pen_crypt_t dekey,
+                   bool accel)
+{
+    pen_aes_batch_t self = aligned_alloc(16, sizeof(*self));
+
+    if (self == NULL)
+        return NULL;
+    memset(self, 0, sizeof(*self));
+    self->enkey_ = enkey;
+    self->dekey_ = dekey;
+
+#ifdef PEN_HAVE_AESNI
+    if (accel && __builtin_cpu_supports("aes")) {
+        uint8_t key[16] = {0};
+
+        memcpy(key, passwd, strnlen(passwd, sizeof(key)));
+        _aesni_init(self, key);
+        self->accel_ = _aesni_check(self);
+    }
+#else
+    (void)passwd;
+    (void)accel;
+#endif
+    return self;
+}
+
+bool
+pen_aes_batch_accelerated(pen_aes_batch_t self)
+{
+    return self->accel_;
+}
+
+void
+pen_aes_batch_encrypt(pen_aes_batch_t self, pen_aes_data_t *data, size_t num)
+{
+#ifdef PEN_HAVE_AESNI
+    if (self->accel_)
+        return _aesni_encrypt(self, data, num);
+#endif
+    for (size_t i = 0; i < num; i++)
+        pen_crypt_aes_encrypt(self->enkey_, &data[i]);
+}
+
+void
+pen_aes_batch_decrypt(pen_aes_batch_t self, pen_aes_data_t *data, size_t num)
+{
+#ifdef PEN_HAVE_AESNI
+    if (self->accel_)
+        return _aesni_decrypt(self, data, num);
+#endif
+    for (size_t i = 0; i < num; i++)
+        pen_crypt_aes_decrypt(self->dekey_, &data[i]);
+}
+
+void
+pen_aes_batch_destroy(pen_aes_batch_t self)
+{
+    free(self);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_AES_BATCH_H
+#define PEN_AES_BATCH_H
+
+#include <stddef.h>
+
+#include <pen_crypt/pen_aes.h>
+
+typedef struct pen_aes_batch_s *pen_aes_batch_t;
+
+/*
+ * Wraps a pen_crypt key pair. With `accel` set and a CPU that has AES-NI,
+ * blocks are processed with pipelined AES-NI instructions; the AES-NI key
+ * schedule is checked against pen_crypt first and dropped if it disagrees.
+ * Otherwise every block goes through pen_crypt_aes_encrypt/decrypt.
+ * `dekey` may be NULL when only encrypting.
+ */
+pen_aes_batch_t pen_aes_batch_init(const char *passwd, pen_crypt_t enkey,
+                                   pen_crypt_t dekey, bool accel);
+bool pen_aes_batch_accelerated(pen_aes_batch_t self);
+void pen_aes_batch_encrypt(pen_aes_batch_t self, pen_aes_data_t *data, size_t num);
+void pen_aes_batch_decrypt(pen_aes_batch_t self, pen_aes_data_t *data, size_t num);
+void pen_aes_batch_destroy(pen_aes_batch_t self);
+
+#endif /* PEN_AES_BATCH_H */
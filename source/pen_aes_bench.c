@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pen_utils/pen_options.h>
+#include <pen_crypt/pen_aes.h>
+
+#include "pen_aes_batch.h"
+
+static const char *passwd = "pen_aes_bench_16";
+static uint32_t blocks = 1024;
+static uint32_t rounds = 10000;
+
+static inline void
+_init_options(int argc, char *argv[])
+{
+#define _li(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT32, d},
+#define _s(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_STRING, d},
+
+    pen_option_t opts[] = {
+        _s(--password, passwd, "aes password(default pen_aes_bench_16)")
+        _li(--blocks, blocks, "blocks per batch(default 1024)")
+        _li(--rounds, rounds, "batches per test(default 10000)")
+    };
+
+    PEN_OPTIONS_INIT(argc, argv, opts);
+#undef _li
+#undef _s
+}
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+_report(const char *name, double elapsed)
+{
+    double total = (double)blocks * rounds;
+
+    printf("%-16s %14.0f blocks/s %10.2f ns/block %10.2f MB/s\n", name,
+           total / elapsed, elapsed * 1e9 / total,
+           total * sizeof(pen_aes_data_t) / elapsed / 1e6);
+}
+
+static void
+_bench(const char *name, pen_aes_batch_t aes, pen_aes_data_t *data)
+{
+    double start = _now();
+
+    for (uint32_t i = 0; i < rounds; i++)
+        pen_aes_batch_encrypt(aes, data, blocks);
+    _report(name, _now() - start);
+
+    start = _now();
+    for (uint32_t i = 0; i < rounds; i++)
+        pen_aes_batch_decrypt(aes, data, blocks);
+    _report("  decrypt", _now() - start);
+}
+
+int
+main(int argc, char *argv[])
+{
+    pen_crypt_t enkey, dekey;
+    pen_aes_batch_t scalar, accel;
+    pen_aes_data_t *data, *check;
+
+    _init_options(argc, argv);
+    pen_assert2(blocks > 0 && rounds > 0);
+
+    enkey = pen_crypt_aes_encrypt_init((const uint8_t*)passwd);
+    pen_assert2(enkey != NULL);
+    dekey = pen_crypt_aes_decrypt_init((const uint8_t*)passwd);
+    pen_assert2(dekey != NULL);
+    scalar = pen_aes_batch_init(passwd, enkey, dekey, false);
+    pen_assert2(scalar != NULL);
+    accel = pen_aes_batch_init(passwd, enkey, dekey, true);
+    pen_assert2(accel != NULL);
+
+    data = malloc(blocks * sizeof(pen_aes_data_t));
+    check = malloc(blocks * sizeof(pen_aes_data_t));
+    pen_assert2(data != NULL && check != NULL);
+    for (uint32_t i = 0; i < blocks; i++) {
+        data[i].u_[0] = i;
+        data[i].u_[1] = ~i;
+        data[i].u_[2] = i * 2654435761u;
+        data[i].u_[3] = 0x1c2b8695;
+    }
+
+    _bench("pen_crypt", scalar, data);
+    if (!pen_aes_batch_accelerated(accel)) {
+        puts("aes-ni not available");
+        goto done;
+    }
+
+    /* both paths have to agree before the numbers mean anything */
+    memcpy(check, data, blocks * sizeof(pen_aes_data_t));
+    pen_aes_batch_encrypt(scalar, check, blocks);
+    pen_aes_batch_encrypt(accel, data, blocks);
+    pen_assert2(memcmp(check, data, blocks * sizeof(pen_aes_data_t)) == 0);
+    pen_aes_batch_decrypt(accel, data, blocks);
+
+    _bench("aes-ni", accel, data);
+done:
+    free(check);
+    free(data);
+    pen_aes_batch_destroy(accel);
+    pen_aes_batch_destroy(scalar);
+    pen_crypt_aes_destroy(enkey);
+    pen_crypt_aes_destroy(dekey);
+    return 0;
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <pen_utils/pen_options.h>
+#include <pen_socket/pen_event.h>
+#include <pen_socket/pen_signal.h>
+#include <pen_socket/pen_socket.h>
+#include <pen_socket/pen_timer.h>
+#include <pen_test/pen_speed.h>
+
+#include "pen_loop.h"
+
+#define PEN_READ_SIZE 65536
+#define PEN_MAX_WRITES 16
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+#if defined(__linux__) && !defined(SO_ZEROCOPY)
+#define SO_ZEROCOPY 60
+#endif
+#if defined(__linux__) && !defined(MSG_ZEROCOPY)
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+static bool running = true;
+static uint16_t port = 1234;
+static uint16_t conn_num = 16;
+static uint16_t duration = 10;
+static uint16_t zerocopy = 0;
+static uint16_t use_sendfile = 0;
+static uint32_t size = 65536;
+static size_t length = 0;
+static const char *host = "127.0.0.1";
+static const char *file = NULL;
+static char *payload = NULL;
+static int file_fd = -1;
+static uint16_t alive = 0;
+static pen_speed_t tx_speeder;
+static pen_speed_t rx_speeder;
+
+typedef struct {
+    pen_event_base_t eb_;
+    size_t offset_;
+    bool connected_;
+} pen_connector_t;
+
+static void _on_event(pen_event_base_t *, uint16_t);
+PEN_LOOP_TIMED(_on_event)
+
+static void
+create_connector(pen_event_t ev, pen_connector_t *self)
+{
+    pen_assert2(pen_connect_tcp(&self->eb_, host, port));
+
+    self->eb_.on_event_ = _on_event_timed;
+
+    pen_assert2(pen_event_add_rw(ev, (pen_event_base_t*)self));
+}
+
+static inline void
+_init_options(int argc, char *argv[])
+{
+#define _i(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT16, d},
+#define _li(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT32, d},
+#define _s(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_STRING, d},
+
+    pen_option_t opts[] = {
+        _i(--port, port, "port(default 1234)")
+        _s(--host, host, "remote host(default 127.0.0.1)")
+        _i(--conns, conn_num, "connection number(default 16)")
+        _li(--size, size, "bytes per write(default 65536)")
+        _i(--duration, duration, "test seconds(default 10)")
+        _i(--zerocopy, zerocopy, "send with MSG_ZEROCOPY(default 0)")
+        _s(--file, file, "send the content of this file in --size pieces, over and over(default NULL)")
+        _i(--sendfile, use_sendfile, "use sendfile for --file(default 0)")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
+    };
+
+    PEN_OPTIONS_INIT(argc, argv, opts);
+#undef _i
+#undef _li
+#undef _s
+}
+
+static void
+_on_signal(int sig PEN_UNUSED)
+{
+    fflush(NULL);
+    running = false;
+}
+
+static bool
+_keep_running(void *user PEN_UNUSED)
+{
+    return running && alive > 0;
+}
+
+static void
+_on_close(pen_event_base_t *eb)
+{
+    pen_connector_t *self = (pen_connector_t*)eb;
+
+    if (eb->fd_ == PEN_INVALID_SOCK)
+        return;
+    close(eb->fd_);
+    eb->fd_ = PEN_INVALID_SOCK;
+    self->connected_ = false;
+    alive--;
+}
+
+#ifdef __linux__
+/* completions only tell us the pages are free again, the payload never changes */
+static void
+_drain_zerocopy(pen_event_base_t *eb)
+{
+    char control[128];
+    struct msghdr msg;
+
+    do {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+    } while (recvmsg(eb->fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+}
+#endif
+
+/* at most --size bytes per call, wrapping around the end of the payload */
+static ssize_t
+_send_chunk(pen_connector_t *self)
+{
+    pen_event_base_t *eb = &self->eb_;
+    size_t len = length - self->offset_;
+    ssize_t ret;
+
+    if (len > size)
+        len = size;
+#ifdef __linux__
+    if (use_sendfile) {
+        off_t off = self->offset_;
+        ret = sendfile(eb->fd_, file_fd, &off, len);
+        goto done;
+    }
+#endif
+    ret = send(eb->fd_, payload + self->offset_, len,
+               MSG_DONTWAIT | MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+#ifdef __linux__
+    if (zerocopy)
+        _drain_zerocopy(eb);
+done:
+#endif
+    if (ret > 0) {
+        self->offset_ += ret;
+        if (self->offset_ == length)
+            self->offset_ = 0;
+    }
+    return ret;
+}
+
+static void
+_on_write(pen_event_base_t *eb)
+{
+    pen_connector_t *self = (pen_connector_t *)eb;
+    ssize_t ret = 0;
+
+    if (!self->connected_) {
+        self->connected_ = true;
+        if (zerocopy)
+            pen_assert2(pen_set_sockopt(eb->fd_, SO_ZEROCOPY, 1));
+    }
+
+    /* keep the socket buffer full, bounded so other connections get a turn */
+    for (int i = 0; i < PEN_MAX_WRITES; i++) {
+        ret = _send_chunk(self);
+        if (ret <= 0)
+            break;
+        pen_speed_add(&tx_speeder, ret);
+    }
+
+    if (ret < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        PEN_WARN("send error!!!");
+        _on_close(eb);
+    }
+}
+
+static void
+_on_event(pen_event_base_t *eb, uint16_t pe)
+{
+    static char buf[PEN_READ_SIZE];
+    int ret;
+
+    if (pe == PEN_EVENT_CLOSE)
+        return _on_close(eb);
+
+    if (pe & PEN_EVENT_WRITE)
+        _on_write(eb);
+
+    if ((pe & PEN_EVENT_READ) == 0 || eb->fd_ == PEN_INVALID_SOCK)
+        return;
+
+    /* an echo target sends everything back, drop it */
+    ret = recv(eb->fd_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret > 0) {
+        pen_speed_add(&rx_speeder, ret);
+        return;
+    }
+    if (ret == 0 || errno != EAGAIN) {
+        PEN_WARN("read error!!!");
+        _on_close(eb);
+    }
+}
+
+static void
+_on_timer(void *arg PEN_UNUSED)
+{
+    pen_speed_current(&tx_speeder);
+    pen_speed_current(&rx_speeder);
+}
+
+static void
+_on_stop(void *arg PEN_UNUSED)
+{
+    running = false;
+}
+
+static void
+_init_payload(void)
+{
+    struct stat st;
+
+    if (file == NULL) {
+        length = size;
+        payload = malloc(size);
+        pen_assert2(payload != NULL);
+        for (uint32_t i = 0; i < size; i++)
+            payload[i] = 'a' + i % 26;
+        return;
+    }
+
+    file_fd = open(file, O_RDONLY | O_CLOEXEC);
+    pen_assert2(file_fd >= 0);
+    pen_assert2(fstat(file_fd, &st) == 0 && st.st_size > 0);
+    length = st.st_size;
+
+    if (use_sendfile)
+        return;
+    payload = mmap(NULL, length, PROT_READ, MAP_SHARED | MAP_POPULATE, file_fd, 0);
+    pen_assert2(payload != MAP_FAILED);
+}
+
+int
+main(int argc, char *argv[])
+{
+    pen_event_t ev;
+    pen_connector_t *conns;
+    pen_event_base_t *timer;
+    pen_event_base_t *stopper;
+
+    _init_options(argc, argv);
+#ifndef __linux__
+    pen_assert2(!zerocopy && !use_sendfile);
+#endif
+    pen_assert2(!use_sendfile || file != NULL);
+    pen_assert2(size > 0 && conn_num > 0);
+    _init_payload();
+
+    ev = pen_event_init(16);
+    pen_assert2(ev != NULL);
+
+    pen_assert2(pen_signal_init(ev));
+    pen_assert2(pen_signal(SIGTERM, _on_signal));
+    pen_assert2(pen_signal(SIGINT, _on_signal));
+
+    timer = pen_timer_init(ev, _on_timer, NULL);
+    pen_assert2(timer != NULL);
+    stopper = pen_timer_init(ev, _on_stop, NULL);
+    pen_assert2(stopper != NULL);
+
+    conns = calloc(conn_num, sizeof(pen_connector_t));
+    pen_assert2(conns != NULL);
+    for (uint16_t i = 0; i < conn_num; i++)
+        create_connector(ev, &conns[i]);
+    alive = conn_num;
+
+    pen_speed_init(&tx_speeder, "blast tx bytes");
+    pen_speed_init(&rx_speeder, "blast rx bytes");
+    pen_timer_settime(timer, 1000);
+    pen_timer_settime_once(stopper, duration * 1000);
+
+    pen_loop_run("blast", ev, -1, true, _keep_running, NULL);
+
+    pen_speed_end(&tx_speeder);
+    pen_speed_end(&rx_speeder);
+    for (uint16_t i = 0; i < conn_num; i++) {
+        if (conns[i].eb_.fd_ != PEN_INVALID_SOCK)
+            close(conns[i].eb_.fd_);
+    }
+    pen_timer_destroy(stopper);
+    pen_timer_destroy(timer);
+    pen_signal_destroy();
+    pen_event_destroy(ev);
+    free(conns);
+
+    if (file == NULL)
+        free(payload);
+    else if (payload != NULL)
+        munmap(payload, length);
+    if (file_fd != -1)
+        close(file_fd);
+
+    puts("exit.");
+    return 0;
+}
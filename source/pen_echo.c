@@ -14,31 +14,102 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <pen_socket/pen_event.h>
 #include <pen_socket/pen_socket.h>
 #include <pen_socket/pen_listener.h>
 #include <pen_socket/pen_signal.h>
+#include <pen_socket/pen_timer.h>
 #include <pen_utils/pen_options.h>
+#include <pen_utils/pen_memory_pool.h>
+#include <pen_test/pen_speed.h>
+
+#include "pen_loop.h"
+
+#define PEN_RING_SIZE (1u << 20)
+#define PEN_RING_ALIGN 4096
+#define PEN_PIPE_SIZE 65536
+#define PEN_FRAME_HEAD sizeof(uint32_t)
+
+typedef enum {
+    PEN_SINK_PRINT,
+    PEN_SINK_BUFFER,
+    PEN_SINK_SPLICE,
+} pen_sink_mode_t;
+
+typedef enum {
+    PEN_FRAME_NONE,
+    PEN_FRAME_LINE,
+    PEN_FRAME_LENGTH,
+} pen_frame_mode_t;
+
+typedef struct {
+    char *buf_;
+    size_t head_;
+    size_t tail_;
+} pen_ring_t;
+
+typedef struct {
+    pen_event_base_t eb_;
+    pen_event_t ev_;
+    char *buf_;
+    uint32_t len_;
+    uint32_t left_;
+    uint32_t off_;
+    uint16_t watch_;
+} pen_client_t;
 
 static bool running = true;
 static uint16_t port = 1234;
+static uint16_t budget = 16;
+static uint32_t bufsize = 10240;
+static const char *mode = "sink";
+static const char *sink = "print";
+static const char *frame = "none";
+static const char *out = NULL;
+static pen_sink_mode_t sink_mode = PEN_SINK_PRINT;
+static pen_frame_mode_t frame_mode = PEN_FRAME_NONE;
+static FILE *out_fp = NULL;
+static int out_fd = -1;
+static pen_ring_t ring;
+static int pipes[2] = {-1, -1};
+static pen_memory_pool_t pool = NULL;
+static pen_memory_pool_t buf_pool = NULL;
+static bool echo = false;
+static pen_speed_t speeder;
 
 static inline void
 _init_options(int argc, char *argv[])
 {
 #define _i(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT16, d},
+#define _li(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT32, d},
+#define _s(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_STRING, d},
 
     pen_option_t opts[] = {
         _i(--port, port, "port(default 1234)")
+        _s(--mode, mode, "sink or echo(default sink)")
+        _s(--sink, sink, "print, buffer or splice(default print)")
+        _s(--out, out, "output file(default stdout)")
+        _s(--frame, frame, "none, line or length(default none)")
+        _li(--bufsize, bufsize, "per client buffer size(default 10240)")
+        _i(--budget, budget, "reads per client and wakeup(default 16)")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
     };
 
     PEN_OPTIONS_INIT(argc, argv, opts);
 #undef _i
+#undef _li
+#undef _s
 }
 
 static void
@@ -49,31 +120,320 @@ _on_signal(int sig PEN_UNUSED)
 }
 
 static void
-do_client(pen_event_base_t *eb)
+_ring_flush(void)
+{
+    struct iovec iov[2];
+    size_t used, pos, first;
+    ssize_t ret;
+
+    while ((used = ring.tail_ - ring.head_) > 0) {
+        pos = ring.head_ & (PEN_RING_SIZE - 1);
+        first = PEN_RING_SIZE - pos;
+        iov[0].iov_base = ring.buf_ + pos;
+        iov[0].iov_len = used < first ? used : first;
+        iov[1].iov_base = ring.buf_;
+        iov[1].iov_len = used - iov[0].iov_len;
+
+        ret = writev(out_fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write output failed");
+            ring.head_ = ring.tail_;
+            return;
+        }
+        ring.head_ += ret;
+    }
+}
+
+static inline size_t
+_ring_room(void)
+{
+    size_t pos = ring.tail_ & (PEN_RING_SIZE - 1);
+    size_t room = PEN_RING_SIZE - (ring.tail_ - ring.head_);
+
+    return room < PEN_RING_SIZE - pos ? room : PEN_RING_SIZE - pos;
+}
+
+static void
+_emit(const char *data, size_t size)
+{
+    size_t room;
+
+    if (sink_mode == PEN_SINK_PRINT) {
+        fwrite(data, 1, size, out_fp);
+        return;
+    }
+
+    while (size > 0) {
+        if (ring.tail_ - ring.head_ == PEN_RING_SIZE)
+            _ring_flush();
+        room = _ring_room();
+        if (room > size)
+            room = size;
+        memcpy(ring.buf_ + (ring.tail_ & (PEN_RING_SIZE - 1)), data, room);
+        ring.tail_ += room;
+        data += room;
+        size -= room;
+    }
+}
+
+/* emit every complete message of the client buffer, returns bytes consumed */
+static uint32_t
+_emit_frames(pen_client_t *self)
+{
+    uint32_t used = 0, size;
+    char *nl;
+
+    switch (frame_mode) {
+    case PEN_FRAME_LINE:
+        nl = memrchr(self->buf_, '\n', self->len_);
+        if (nl != NULL)
+            used = nl - self->buf_ + 1;
+        else if (self->len_ == bufsize)
+            used = self->len_;
+        _emit(self->buf_, used);
+        return used;
+    case PEN_FRAME_LENGTH:
+        for (;;) {
+            /* frames larger than the buffer are passed through in pieces */
+            if (self->left_ > 0) {
+                size = self->len_ - used;
+                if (size > self->left_)
+                    size = self->left_;
+                _emit(self->buf_ + used, size);
+                used += size;
+                self->left_ -= size;
+                if (self->left_ > 0)
+                    return used;
+                continue;
+            }
+            if (self->len_ - used < PEN_FRAME_HEAD)
+                return used;
+            memcpy(&size, self->buf_ + used, PEN_FRAME_HEAD);
+            size = ntohl(size);
+            if (size <= self->len_ - used - PEN_FRAME_HEAD) {
+                _emit(self->buf_ + used + PEN_FRAME_HEAD, size);
+                used += PEN_FRAME_HEAD + size;
+            } else if (size <= bufsize - PEN_FRAME_HEAD) {
+                return used;
+            } else {
+                used += PEN_FRAME_HEAD;
+                self->left_ = size;
+            }
+        }
+    default:
+        _emit(self->buf_, self->len_);
+        return self->len_;
+    }
+}
+
+/*
+ * The _read_* helpers drain the socket until EAGAIN or until the client
+ * used up its budget of reads for this wakeup. They return > 0 while the
+ * client is alive, 0 when it closed and < 0 on error.
+ */
+static int
+_read_client(pen_client_t *self)
 {
-#define PEN_BUF_SIZE 10240
-    static char buf[PEN_BUF_SIZE];
+    uint32_t used;
     int ret = 0;
 
-again:
-    ret = read(eb->fd_, buf, PEN_BUF_SIZE);
-    if (ret == 0)
-        goto end;
+    for (uint16_t i = 0; i < budget; i++) {
+        ret = recv(self->eb_.fd_, self->buf_ + self->len_,
+                   bufsize - self->len_, MSG_DONTWAIT);
+        if (ret <= 0)
+            break;
 
-    if (ret < 0) {
-        perror("unknown error");
-        goto end;
+        self->len_ += ret;
+        used = _emit_frames(self);
+        self->len_ -= used;
+        if (used > 0 && self->len_ > 0)
+            memmove(self->buf_, self->buf_ + used, self->len_);
     }
 
-    printf("%.*s", ret, buf);
-    if (ret == PEN_BUF_SIZE)
-        goto again;
+    if (sink_mode == PEN_SINK_BUFFER && ring.tail_ - ring.head_ >= PEN_RING_SIZE / 2)
+        _ring_flush();
+    if (ret < 0 && errno == EAGAIN)
+        return 1;
+    return ret;
+}
+
+/* without framing read straight into the free space of the ring */
+static int
+_read_buffered(pen_client_t *self)
+{
+    int ret = 0;
+
+    for (uint16_t i = 0; i < budget; i++) {
+        if (ring.tail_ - ring.head_ == PEN_RING_SIZE)
+            _ring_flush();
+
+        ret = recv(self->eb_.fd_, ring.buf_ + (ring.tail_ & (PEN_RING_SIZE - 1)),
+                   _ring_room(), MSG_DONTWAIT);
+        if (ret <= 0)
+            break;
+        ring.tail_ += ret;
+    }
+
+    if (ring.tail_ - ring.head_ >= PEN_RING_SIZE / 2)
+        _ring_flush();
+    if (ret < 0 && errno == EAGAIN)
+        return 1;
+    return ret;
+}
+
+#ifdef __linux__
+static void
+_init_pipe(void)
+{
+    pen_assert2(pipe2(pipes, O_CLOEXEC) == 0);
+    fcntl(pipes[1], F_SETPIPE_SZ, PEN_PIPE_SIZE);
+}
+
+/* move socket data to the output through a pipe, never touching user space */
+static int
+_read_splice(pen_client_t *self)
+{
+    ssize_t ret = 0, n;
+    int dest = pipes[1] == -1 ? out_fd : pipes[1];
+
+    for (uint16_t i = 0; i < budget; i++) {
+        ret = splice(self->eb_.fd_, NULL, dest, NULL, PEN_PIPE_SIZE,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret <= 0)
+            break;
+
+        for (n = ret; pipes[0] != -1 && n > 0; ) {
+            ssize_t m = splice(pipes[0], NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+            if (m <= 0) {
+                perror("splice to output failed");
+                /* the pipe is shared, leftovers must not reach the next client */
+                close(pipes[0]);
+                close(pipes[1]);
+                _init_pipe();
+                return -1;
+            }
+            n -= m;
+        }
+    }
+
+    if (ret < 0 && errno == EAGAIN)
+        return 1;
+    return ret;
+}
+#endif
+
+/* write back what is queued, returns < 0 on error */
+static int
+_echo_write(pen_client_t *self)
+{
+    ssize_t ret;
+
+    if (self->off_ == self->len_)
+        return 1;
+
+    ret = send(self->eb_.fd_, self->buf_ + self->off_, self->len_ - self->off_,
+               MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0)
+        return errno == EAGAIN ? 1 : -1;
+
+    pen_speed_add(&speeder, ret);
+    self->off_ += ret;
+    if (self->off_ == self->len_)
+        self->off_ = self->len_ = 0;
+    return 1;
+}
+
+/*
+ * Read as long as there is room in the client buffer and write back right
+ * away. Whatever the peer does not take stays queued, and the client then
+ * waits for write readiness; a full buffer stops reading altogether.
+ */
+static int
+_read_echo(pen_client_t *self, uint16_t pe)
+{
+    uint16_t watch;
+    int ret = 1;
+
+    if ((pe & PEN_EVENT_WRITE) && _echo_write(self) < 0)
+        return -1;
+
+    for (uint16_t i = 0; (pe & PEN_EVENT_READ) && i < budget; i++) {
+        if (self->len_ == bufsize) {
+            if (self->off_ == 0)
+                break;
+            memmove(self->buf_, self->buf_ + self->off_, self->len_ - self->off_);
+            self->len_ -= self->off_;
+            self->off_ = 0;
+        }
+
+        ret = recv(self->eb_.fd_, self->buf_ + self->len_,
+                   bufsize - self->len_, MSG_DONTWAIT);
+        if (ret <= 0)
+            break;
+        self->len_ += ret;
+        if (_echo_write(self) < 0)
+            return -1;
+    }
+    if (ret == 0 || (ret < 0 && errno != EAGAIN))
+        return ret;
+
+    if (self->len_ == bufsize && self->off_ == 0)
+        watch = PEN_EVENT_WRITE;
+    else if (self->len_ > self->off_)
+        watch = PEN_EVENT_READ | PEN_EVENT_WRITE;
+    else
+        watch = PEN_EVENT_READ;
+
+    if (watch != self->watch_) {
+        if (watch == PEN_EVENT_WRITE)
+            pen_assert2(pen_event_mod_w(self->ev_, &self->eb_));
+        else if (watch == PEN_EVENT_READ)
+            pen_assert2(pen_event_mod_r(self->ev_, &self->eb_));
+        else
+            pen_assert2(pen_event_mod_rw(self->ev_, &self->eb_));
+        self->watch_ = watch;
+    }
+    return 1;
+}
+
+static void
+_free_client(pen_client_t *self)
+{
+    /* whatever is left of an unterminated line still goes out */
+    if (!echo && frame_mode == PEN_FRAME_LINE && self->len_ > 0)
+        _emit(self->buf_, self->len_);
+    if (self->buf_ != NULL)
+        pen_memory_pool_put(buf_pool, self->buf_);
+    pen_memory_pool_put(pool, self);
+}
+
+static void
+do_client(pen_client_t *self, uint16_t pe)
+{
+    int ret = 0;
+
+    if (echo)
+        ret = _read_echo(self, pe);
+    else if (sink_mode == PEN_SINK_BUFFER && frame_mode == PEN_FRAME_NONE)
+        ret = _read_buffered(self);
+#ifdef __linux__
+    else if (sink_mode == PEN_SINK_SPLICE)
+        ret = _read_splice(self);
+#endif
+    else
+        ret = _read_client(self);
+
+    if (ret > 0)
+        return;
+
+    if (ret < 0)
+        perror("unknown error");
 
-    return;
-end:
     PEN_INFO("client closed.");
-    close(eb->fd_);
-    free(eb);
+    close(self->eb_.fd_);
+    _free_client(self);
 }
 
 static void
@@ -81,12 +441,13 @@ _on_event(pen_event_base_t *eb, uint16_t pe)
 {
     if (pe == PEN_EVENT_CLOSE) {
         PEN_INFO("client closed.");
-        free(eb);
+        _free_client((pen_client_t *)eb);
         return;
     }
-    do_client(eb);
+    do_client((pen_client_t *)eb, pe);
 }
 
+PEN_LOOP_TIMED(_on_event)
 
 static pen_event_base_t *
 on_new_client(pen_event_t ev,
@@ -94,26 +455,107 @@ on_new_client(pen_event_t ev,
               void *user PEN_UNUSED,
               struct sockaddr_in *addr PEN_UNUSED)
 {
-    pen_event_base_t *eb = NULL;
+    pen_client_t *self = NULL;
+
+    self = pen_memory_pool_get(pool);
+    pen_assert2(self != NULL);
+    memset(self, 0, sizeof(*self));
+    self->eb_.fd_ = fd;
+    self->eb_.on_event_ = _on_event_timed;
+    self->ev_ = ev;
+    self->watch_ = PEN_EVENT_READ;
 
-    eb = calloc(1, sizeof(*eb));
-    eb->fd_ = fd;
-    eb->on_event_ = _on_event;
+    if (buf_pool != NULL) {
+        self->buf_ = pen_memory_pool_get(buf_pool);
+        pen_assert2(self->buf_ != NULL);
+    }
 
-    pen_assert2(pen_event_add_r(ev, eb));
+    pen_assert2(pen_event_add_r(ev, &self->eb_));
 
-    return eb;
+    return &self->eb_;
+}
+
+static bool
+_keep_running(void *user PEN_UNUSED)
+{
+    return running;
 }
 
 static void
-start_server(pen_event_t ev)
+_on_timer(void *arg PEN_UNUSED)
 {
-    int ret = 0;
+    if (echo)
+        pen_speed_current(&speeder);
+    else
+        _ring_flush();
+}
+
+static void
+_init_frame(void)
+{
+    if (strcmp(mode, "echo") == 0)
+        echo = true;
+    else
+        pen_assert2(strcmp(mode, "sink") == 0);
+
+    if (strcmp(frame, "line") == 0)
+        frame_mode = PEN_FRAME_LINE;
+    else if (strcmp(frame, "length") == 0)
+        frame_mode = PEN_FRAME_LENGTH;
+    else
+        pen_assert2(strcmp(frame, "none") == 0);
+
+    pen_assert2(bufsize > PEN_FRAME_HEAD && budget > 0);
+}
+
+static void
+_init_sink(void)
+{
+    struct stat st;
 
-    do {
-        fflush(NULL);
-        ret = pen_event_wait(ev, -1);
-    } while (running && ret >= 0);
+    out_fp = stdout;
+    if (out != NULL) {
+        /* appends by position, splice refuses an O_APPEND output */
+        out_fd = open(out, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        pen_assert2(out_fd != -1);
+        pen_assert2(lseek(out_fd, 0, SEEK_END) != -1);
+        out_fp = fdopen(out_fd, "w");
+        pen_assert2(out_fp != NULL);
+    }
+    out_fd = fileno(out_fp);
+
+    if (strcmp(sink, "buffer") == 0) {
+        sink_mode = PEN_SINK_BUFFER;
+    } else if (strcmp(sink, "splice") == 0) {
+        sink_mode = PEN_SINK_SPLICE;
+    } else {
+        pen_assert2(strcmp(sink, "print") == 0);
+        return;
+    }
+
+#ifdef __linux__
+    if (sink_mode == PEN_SINK_SPLICE && frame_mode != PEN_FRAME_NONE) {
+        PEN_WARN("splice can not keep frames, using buffer sink.");
+    } else if (sink_mode == PEN_SINK_SPLICE && (fcntl(out_fd, F_GETFL) & O_APPEND)) {
+        /* e.g. stdout redirected with >> */
+        PEN_WARN("splice can not write an O_APPEND output, using buffer sink.");
+    } else if (sink_mode == PEN_SINK_SPLICE) {
+        pen_assert2(fstat(out_fd, &st) == 0);
+        if (S_ISREG(st.st_mode)) {
+            _init_pipe();
+            return;
+        }
+        if (S_ISFIFO(st.st_mode))
+            return;
+        PEN_WARN("splice needs a pipe or a file, using buffer sink.");
+    }
+#else
+    (void)st;
+#endif
+
+    sink_mode = PEN_SINK_BUFFER;
+    ring.buf_ = aligned_alloc(PEN_RING_ALIGN, PEN_RING_SIZE);
+    pen_assert2(ring.buf_ != NULL);
 }
 
 int
@@ -121,8 +563,19 @@ main(int argc, char *argv[])
 {
     pen_listener_t listener;
     pen_event_t ev;
+    pen_event_base_t *timer = NULL;
 
     _init_options(argc, argv);
+    _init_frame();
+    if (!echo)
+        _init_sink();
+
+    pool = PEN_MEMORY_POOL_INIT(16, pen_client_t);
+    pen_assert2(pool != NULL);
+    if (echo || sink_mode == PEN_SINK_PRINT || frame_mode != PEN_FRAME_NONE) {
+        buf_pool = pen_memory_pool_init(16, bufsize);
+        pen_assert2(buf_pool != NULL);
+    }
 
     ev = pen_event_init(16);
     pen_assert2(ev != NULL);
@@ -134,13 +587,37 @@ main(int argc, char *argv[])
     listener = pen_listener_init(ev, NULL, port, 10, on_new_client, NULL);
     pen_assert2(listener != NULL);
 
-    start_server(ev);
+    if (echo || sink_mode == PEN_SINK_BUFFER) {
+        timer = pen_timer_init(ev, _on_timer, NULL);
+        pen_assert2(timer != NULL);
+        pen_timer_settime(timer, echo ? 10000 : 100);
+    }
+    if (echo)
+        pen_speed_init(&speeder, "echo bytes");
+
+    pen_loop_run("echo", ev, -1, !echo && sink_mode == PEN_SINK_PRINT,
+                 _keep_running, NULL);
 
+    if (echo)
+        pen_speed_end(&speeder);
+    if (timer != NULL) {
+        pen_timer_destroy(timer);
+        _ring_flush();
+    }
+    free(ring.buf_);
+    if (pipes[0] != -1) {
+        close(pipes[0]);
+        close(pipes[1]);
+    }
+    if (out_fp != stdout)
+        fclose(out_fp);
     pen_listener_destroy(listener);
     pen_signal_destroy();
     pen_event_destroy(ev);
+    if (buf_pool != NULL)
+        pen_memory_pool_destroy(buf_pool);
+    pen_memory_pool_destroy(pool);
     puts("exit.\n");
 
     return 0;
 }
-
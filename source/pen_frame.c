@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <pen_utils/pen_types.h>
+
+#include "pen_frame.h"
+
+static inline uint64_t
+_get64(const uint8_t *p)
+{
+    return (uint64_t)pen_frame_get32(p) << 32 | pen_frame_get32(p + 4);
+}
+
+static inline void
+_put64(uint8_t *p, uint64_t v)
+{
+    pen_frame_put32(p, v >> 32);
+    pen_frame_put32(p + 4, (uint32_t)v);
+}
+
+static uint64_t
+_random64(void)
+{
+    uint64_t v = 0;
+
+    while (v == 0) {
+#ifdef __linux__
+        pen_assert2(getrandom(&v, sizeof(v), 0) == sizeof(v));
+#else
+        arc4random_buf(&v, sizeof(v));
+#endif
+    }
+    return v;
+}
+
+struct pen_frame_key_s {
+    EVP_CIPHER_CTX *seal_;
+    EVP_CIPHER_CTX *open_;
+};
+
+pen_frame_key_t
+pen_frame_key_init(const char *passwd)
+{
+    pen_frame_key_t self = calloc(1, sizeof(*self));
+    uint8_t key[16] = {0};
+
+    if (self == NULL)
+        return NULL;
+    /* the same key pen_crypt derived, frames stay compatible */
+    memcpy(key, passwd, strnlen(passwd, sizeof(key)));
+
+    self->seal_ = EVP_CIPHER_CTX_new();
+    self->open_ = EVP_CIPHER_CTX_new();
+    if (self->seal_ == NULL || self->open_ == NULL
+        || EVP_EncryptInit_ex(self->seal_, EVP_aes_128_gcm(), NULL, key, NULL) != 1
+        || EVP_DecryptInit_ex(self->open_, EVP_aes_128_gcm(), NULL, key, NULL) != 1) {
+        pen_frame_key_destroy(self);
+        self = NULL;
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    return self;
+}
+
+void
+pen_frame_key_destroy(pen_frame_key_t self)
+{
+    EVP_CIPHER_CTX_free(self->seal_);
+    EVP_CIPHER_CTX_free(self->open_);
+    free(self);
+}
+
+bool
+pen_frame_aead_seal(pen_frame_key_t key, const uint8_t nonce[12],
+                    const uint8_t *aad, size_t aad_len,
+                    uint8_t *data, size_t len, uint8_t tag[16])
+{
+    EVP_CIPHER_CTX *ctx = key->seal_;
+    int out;
+
+    return EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) == 1
+        && EVP_EncryptUpdate(ctx, NULL, &out, aad, aad_len) == 1
+        && EVP_EncryptUpdate(ctx, data, &out, data, len) == 1
+        && EVP_EncryptFinal_ex(ctx, data + out, &out) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag) == 1;
+}
+
+bool
+pen_frame_aead_open(pen_frame_key_t key, const uint8_t nonce[12],
+                    const uint8_t *aad, size_t aad_len,
+                    uint8_t *data, size_t len, const uint8_t tag[16])
+{
+    EVP_CIPHER_CTX *ctx = key->open_;
+    uint8_t plain[PEN_FRAME_MAX];
+    int out, end;
+    bool ok;
+
+    /* plaintext only reaches `data` once the tag matched */
+    if (len > sizeof(plain))
+        return false;
+    ok = EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, (void *)tag) == 1
+        && EVP_DecryptUpdate(ctx, NULL, &out, aad, aad_len) == 1
+        && EVP_DecryptUpdate(ctx, plain, &out, data, len) == 1
+        && EVP_DecryptFinal_ex(ctx, plain + out, &end) == 1;
+    if (ok)
+        memcpy(data, plain, len);
+    OPENSSL_cleanse(plain, len);
+    return ok;
+}
+
+/* nonce = sid || seq, aad = header || receiver sid */
+static void
+_frame_params(const uint8_t *frame, uint64_t receiver, uint8_t nonce[12],
+              uint8_t aad[PEN_FRAME_HEAD + 8])
+{
+    memcpy(nonce, frame + 8, 8);
+    memcpy(nonce + 8, frame + 4, 4);
+    memcpy(aad, frame, PEN_FRAME_HEAD);
+    _put64(aad + PEN_FRAME_HEAD, receiver);
+}
+
+void
+pen_frame_init(pen_frame_ctx_t *self)
+{
+    memset(self, 0, sizeof(*self));
+    self->sid_ = _random64();
+}
+
+size_t
+pen_frame_seal(pen_frame_ctx_t *self, pen_frame_key_t key, uint8_t type,
+               const void *data, uint16_t len, uint8_t *out)
+{
+    uint8_t nonce[12], aad[PEN_FRAME_HEAD + 8];
+    uint32_t seq;
+
+    if (len > PEN_FRAME_MAX)
+        return 0;
+    if (type == PEN_FRAME_HELLO) {
+        if (self->tx_seq_ != 0 || len != 0)
+            return 0;
+        seq = 0;
+    } else {
+        /* the nonce must never repeat, a fresh connection gets a fresh sid */
+        if (self->peer_ == 0 || self->tx_seq_ == UINT32_MAX)
+            return 0;
+        seq = ++self->tx_seq_;
+    }
+
+    out[0] = PEN_FRAME_VERSION;
+    out[1] = type;
+    out[2] = len >> 8;
+    out[3] = len;
+    pen_frame_put32(out + 4, seq);
+    _put64(out + 8, self->sid_);
+    if (len > 0)
+        memcpy(out + PEN_FRAME_HEAD, data, len);
+
+    _frame_params(out, type == PEN_FRAME_HELLO ? 0 : self->peer_, nonce, aad);
+    if (!pen_frame_aead_seal(key, nonce, aad, sizeof(aad), out + PEN_FRAME_HEAD, len,
+                             out + PEN_FRAME_HEAD + len))
+        return 0;
+    return PEN_FRAME_HEAD + len + PEN_FRAME_TAG;
+}
+
+ssize_t
+pen_frame_recv(pen_frame_ctx_t *self, int fd)
+{
+    ssize_t ret;
+
+    if (self->used_ > 0) {
+        memmove(self->buf_, self->buf_ + self->used_, self->len_ - self->used_);
+        self->len_ -= self->used_;
+        self->used_ = 0;
+    }
+
+    ret = recv(fd, self->buf_ + self->len_, sizeof(self->buf_) - self->len_,
+               MSG_DONTWAIT);
+    if (ret > 0)
+        self->len_ += ret;
+    return ret;
+}
+
+static bool
+_window_check(const pen_frame_ctx_t *self, uint32_t seq)
+{
+    uint32_t diff;
+
+    if (seq == 0)
+        return false;
+    if (seq > self->rx_seq_)
+        return true;
+    diff = self->rx_seq_ - seq;
+    return diff < 64 && (self->rx_window_ & (1ULL << diff)) == 0;
+}
+
+static void
+_window_update(pen_frame_ctx_t *self, uint32_t seq)
+{
+    uint32_t shift;
+
+    if (seq <= self->rx_seq_) {
+        self->rx_window_ |= 1ULL << (self->rx_seq_ - seq);
+        return;
+    }
+    shift = seq - self->rx_seq_;
+    self->rx_window_ = shift >= 64 ? 0 : self->rx_window_ << shift;
+    self->rx_window_ |= 1;
+    self->rx_seq_ = seq;
+}
+
+int
+pen_frame_next(pen_frame_ctx_t *self, pen_frame_key_t key, pen_frame_t *frame)
+{
+    uint8_t *head, nonce[12], aad[PEN_FRAME_HEAD + 8];
+    uint16_t len;
+    uint32_t seq;
+    uint64_t sid;
+
+    if (self->used_ > 0) {
+        memmove(self->buf_, self->buf_ + self->used_, self->len_ - self->used_);
+        self->len_ -= self->used_;
+        self->used_ = 0;
+    }
+
+    head = self->buf_;
+    if (self->len_ < PEN_FRAME_HEAD)
+        return 0;
+    len = head[2] << 8 | head[3];
+    if (head[0] != PEN_FRAME_VERSION || len > PEN_FRAME_MAX)
+        return -1;
+    if (self->len_ < PEN_FRAME_HEAD + len + PEN_FRAME_TAG)
+        return 0;
+
+    seq = pen_frame_get32(head + 4);
+    sid = _get64(head + 8);
+    if (self->peer_ == 0) {
+        if (head[1] != PEN_FRAME_HELLO || seq != 0 || sid == 0 || len != 0)
+            return -1;
+    } else if (head[1] == PEN_FRAME_HELLO || sid != self->peer_
+               || !_window_check(self, seq)) {
+        return -1;
+    }
+
+    _frame_params(head, self->peer_ == 0 ? 0 : self->sid_, nonce, aad);
+    if (!pen_frame_aead_open(key, nonce, aad, sizeof(aad), head + PEN_FRAME_HEAD, len,
+                             head + PEN_FRAME_HEAD + len))
+        return -1;
+
+    if (self->peer_ == 0)
+        self->peer_ = sid;
+    else
+        _window_update(self, seq);
+
+    frame->type_ = head[1];
+    frame->len_ = len;
+    frame->data_ = head + PEN_FRAME_HEAD;
+    self->used_ = PEN_FRAME_HEAD + len + PEN_FRAME_TAG;
+    return 1;
+}
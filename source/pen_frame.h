@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_FRAME_H
+#define PEN_FRAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Keepalive protocol frame, integers in network order:
+ *
+ *     u8 version | u8 type | u16 len | u32 seq | u64 sid | data[len] | tag[16]
+ *
+ * data is sealed with AES-128-GCM from OpenSSL, nonce = sid || seq,
+ * aad = header || receiver sid.
+ * Both sides open with a HELLO (seq 0, no data) carrying a fresh random sid,
+ * so frames captured on another connection never authenticate. Later frames
+ * use seq 1, 2, ... and are checked against a 64 entry replay window.
+ */
+#define PEN_FRAME_VERSION 1
+#define PEN_FRAME_HEAD 16
+#define PEN_FRAME_TAG 16
+#define PEN_FRAME_MAX 256
+#define PEN_FRAME_BUF (PEN_FRAME_HEAD + PEN_FRAME_MAX + PEN_FRAME_TAG)
+
+enum {
+    PEN_FRAME_HELLO = 1,
+    PEN_FRAME_AUTH,     /* u32 id */
+    PEN_FRAME_WATCH,    /* u32 id */
+    PEN_FRAME_IP,       /* n * (u32 id, u32 ip), ip as is on the wire */
+    PEN_FRAME_PING,     /* opaque, sent back as is in a PONG */
+    PEN_FRAME_PONG,
+};
+
+/* the AEAD of one password, AES-128 keyed by its first 16 bytes */
+typedef struct pen_frame_key_s *pen_frame_key_t;
+
+typedef struct {
+    uint8_t type_;
+    uint16_t len_;
+    uint8_t *data_;
+} pen_frame_t;
+
+typedef struct {
+    uint64_t sid_;
+    uint64_t peer_;
+    uint32_t tx_seq_;
+    uint32_t rx_seq_;
+    uint64_t rx_window_;
+    uint16_t len_;
+    uint16_t used_;
+    uint8_t buf_[PEN_FRAME_BUF];
+} pen_frame_ctx_t;
+
+pen_frame_key_t pen_frame_key_init(const char *passwd);
+void pen_frame_key_destroy(pen_frame_key_t key);
+/* raw AES-GCM with a 96 bit nonce, encrypts `data` in place */
+bool pen_frame_aead_seal(pen_frame_key_t key, const uint8_t nonce[12],
+                         const uint8_t *aad, size_t aad_len,
+                         uint8_t *data, size_t len, uint8_t tag[16]);
+/* checks the tag first, `data` is only decrypted when it matches */
+bool pen_frame_aead_open(pen_frame_key_t key, const uint8_t nonce[12],
+                         const uint8_t *aad, size_t aad_len,
+                         uint8_t *data, size_t len, const uint8_t tag[16]);
+
+void pen_frame_init(pen_frame_ctx_t *self);
+/* returns the frame size written to `out`, 0 when this frame can not be sent */
+size_t pen_frame_seal(pen_frame_ctx_t *self, pen_frame_key_t key, uint8_t type,
+                      const void *data, uint16_t len, uint8_t *out);
+/* reads whatever fits into the receive buffer */
+ssize_t pen_frame_recv(pen_frame_ctx_t *self, int fd);
+/* 1: got a frame valid until the next call, 0: need more data, -1: bad peer */
+int pen_frame_next(pen_frame_ctx_t *self, pen_frame_key_t key, pen_frame_t *frame);
+
+static inline uint32_t
+pen_frame_get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void
+pen_frame_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+#endif /* PEN_FRAME_H */
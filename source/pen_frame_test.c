@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "pen_frame.h"
+
+#define _check(x) do { \
+    if (!(x)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+        failed++; \
+    } \
+} while (0)
+
+static int failed = 0;
+
+static size_t
+_hex(const char *hex, uint8_t *out)
+{
+    size_t n = strlen(hex) / 2;
+
+    for (size_t i = 0; i < n; i++)
+        sscanf(hex + i * 2, "%2hhx", &out[i]);
+    return n;
+}
+
+/* AES-128 vectors from the GCM spec (McGrew & Viega), test cases 2 and 4 */
+static const struct {
+    const char *key_, *iv_, *aad_, *plain_, *cipher_, *tag_;
+} vectors[] = {
+    {
+        "00000000000000000000000000000000",
+        "000000000000000000000000",
+        "",
+        "00000000000000000000000000000000",
+        "0388dace60b6a392f328c2b971b2fe78",
+        "ab6e47d42cec13bdf53a67b21257bddf",
+    },
+    {
+        "feffe9928665731c6d6a8f9467308308",
+        "cafebabefacedbaddecaf888",
+        "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+        "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+        "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+        "5bc94fbc3221a5db94fae95ae7121a47",
+    },
+};
+
+static void
+_test_vector(int i)
+{
+    uint8_t passwd[17] = {0}, iv[12], aad[32], plain[64], cipher[64], tag[16];
+    uint8_t data[64], out[16];
+    size_t aad_len, len;
+    pen_frame_key_t key;
+
+    /* the key is the password zero padded to 16 bytes */
+    _hex(vectors[i].key_, passwd);
+    _hex(vectors[i].iv_, iv);
+    aad_len = _hex(vectors[i].aad_, aad);
+    len = _hex(vectors[i].plain_, plain);
+    _hex(vectors[i].cipher_, cipher);
+    _hex(vectors[i].tag_, tag);
+
+    key = pen_frame_key_init((const char *)passwd);
+    _check(key != NULL);
+    if (key == NULL)
+        return;
+
+    memcpy(data, plain, len);
+    _check(pen_frame_aead_seal(key, iv, aad, aad_len, data, len, out));
+    _check(memcmp(data, cipher, len) == 0);
+    _check(memcmp(out, tag, sizeof(tag)) == 0);
+
+    _check(pen_frame_aead_open(key, iv, aad, aad_len, data, len, tag));
+    _check(memcmp(data, plain, len) == 0);
+
+    /* a bad tag, aad or ciphertext leaves the input untouched */
+    memcpy(data, cipher, len);
+    tag[15] ^= 1;
+    _check(!pen_frame_aead_open(key, iv, aad, aad_len, data, len, tag));
+    _check(memcmp(data, cipher, len) == 0);
+    tag[15] ^= 1;
+    if (aad_len > 0) {
+        aad[0] ^= 1;
+        _check(!pen_frame_aead_open(key, iv, aad, aad_len, data, len, tag));
+        _check(memcmp(data, cipher, len) == 0);
+        aad[0] ^= 1;
+    }
+    data[0] ^= 1;
+    _check(!pen_frame_aead_open(key, iv, aad, aad_len, data, len, tag));
+    data[0] ^= 1;
+    _check(memcmp(data, cipher, len) == 0);
+    _check(pen_frame_aead_open(key, iv, aad, aad_len, data, len, tag));
+    _check(memcmp(data, plain, len) == 0);
+
+    pen_frame_key_destroy(key);
+}
+
+static int fds[2];
+
+/* sends through the socket pair, `to` reads the other end */
+static int
+_deliver(int side, pen_frame_ctx_t *to, const uint8_t *buf, size_t size)
+{
+    if (write(fds[side], buf, size) != (ssize_t)size)
+        return -1;
+    return pen_frame_recv(to, fds[side ^ 1]) == (ssize_t)size ? 0 : -1;
+}
+
+static void
+_test_frames(void)
+{
+    uint8_t buf[PEN_FRAME_HEAD + PEN_FRAME_MAX + PEN_FRAME_TAG], saved[sizeof(buf)];
+    pen_frame_key_t key = pen_frame_key_init("secret");
+    pen_frame_key_t other = pen_frame_key_init("public");
+    pen_frame_ctx_t client, server;
+    pen_frame_t frame;
+    size_t size, saved_size;
+
+    _check(key != NULL && other != NULL);
+    _check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    if (failed > 0)
+        return;
+
+    pen_frame_init(&client);
+    pen_frame_init(&server);
+    _check(pen_frame_seal(&client, key, PEN_FRAME_PING, "x", 1, buf) == 0);
+
+    size = pen_frame_seal(&client, key, PEN_FRAME_HELLO, NULL, 0, buf);
+    _check(_deliver(0, &server, buf, size) == 0);
+    _check(pen_frame_next(&server, key, &frame) == 1);
+    _check(frame.type_ == PEN_FRAME_HELLO && server.peer_ == client.sid_);
+    _check(pen_frame_next(&server, key, &frame) == 0);
+
+    size = pen_frame_seal(&server, key, PEN_FRAME_HELLO, NULL, 0, buf);
+    _check(_deliver(1, &client, buf, size) == 0);
+    _check(pen_frame_next(&client, key, &frame) == 1);
+    _check(client.peer_ == server.sid_);
+
+    size = pen_frame_seal(&client, key, PEN_FRAME_PING, "hello", 5, buf);
+    _check(size == PEN_FRAME_HEAD + 5 + PEN_FRAME_TAG);
+    memcpy(saved, buf, size);
+    saved_size = size;
+    _check(_deliver(0, &server, buf, size) == 0);
+    _check(pen_frame_next(&server, key, &frame) == 1);
+    _check(frame.type_ == PEN_FRAME_PING && frame.len_ == 5
+           && memcmp(frame.data_, "hello", 5) == 0);
+
+    /* a replayed frame is refused */
+    _check(_deliver(0, &server, saved, saved_size) == 0);
+    _check(pen_frame_next(&server, key, &frame) == -1);
+    pen_frame_init(&server);
+    server.peer_ = client.sid_;
+    server.sid_ = client.peer_;
+
+    /* so is one sealed with another password */
+    size = pen_frame_seal(&client, other, PEN_FRAME_PING, "hello", 5, buf);
+    _check(_deliver(0, &server, buf, size) == 0);
+    _check(pen_frame_next(&server, key, &frame) == -1);
+
+    close(fds[0]);
+    close(fds[1]);
+    pen_frame_key_destroy(key);
+    pen_frame_key_destroy(other);
+}
+
+int
+main(void)
+{
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+        _test_vector(i);
+    _test_frames();
+
+    if (failed > 0) {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("pen_frame: all checks passed\n");
+    return 0;
+}
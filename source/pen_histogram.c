@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "pen_histogram.h"
+
+/* upper bound of the values that fall in bucket `idx` */
+static uint64_t
+_bucket_value(unsigned idx)
+{
+    unsigned shift;
+
+    if (idx < PEN_HISTOGRAM_SUB_COUNT)
+        return idx;
+
+    shift = idx / PEN_HISTOGRAM_HALF_COUNT - 1;
+    idx = idx - shift * PEN_HISTOGRAM_HALF_COUNT;
+    return (((uint64_t)idx + 1) << shift) - 1;
+}
+
+void
+pen_histogram_reset(pen_histogram_t *self)
+{
+    memset(self, 0, sizeof(*self));
+}
+
+void
+pen_histogram_merge(pen_histogram_t *self, const pen_histogram_t *other)
+{
+    if (other->count_ == 0)
+        return;
+
+    for (unsigned i = 0; i < PEN_HISTOGRAM_SIZE; i++)
+        self->buckets_[i] += other->buckets_[i];
+    self->count_ += other->count_;
+    if (other->max_ > self->max_)
+        self->max_ = other->max_;
+}
+
+uint64_t
+pen_histogram_percentile(const pen_histogram_t *self, double percent)
+{
+    uint64_t rank, seen = 0;
+
+    if (self->count_ == 0)
+        return 0;
+
+    rank = (uint64_t)(self->count_ * percent / 100.0 + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    for (unsigned i = 0; i < PEN_HISTOGRAM_SIZE; i++) {
+        seen += self->buckets_[i];
+        if (seen >= rank) {
+            uint64_t value = _bucket_value(i);
+            return value < self->max_ ? value : self->max_;
+        }
+    }
+    return self->max_;
+}
+
+void
+pen_histogram_print(const pen_histogram_t *self, const char *name)
+{
+#define _us(p) pen_histogram_percentile(self, p) / 1000.0
+
+    printf("%s: count %llu, p50 %.1fus, p90 %.1fus, p99 %.1fus, "
+           "p99.9 %.1fus, max %.1fus\n",
+           name, (unsigned long long)self->count_,
+           _us(50), _us(90), _us(99), _us(99.9), self->max_ / 1000.0);
+#undef _us
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_HISTOGRAM_H
+#define PEN_HISTOGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-linear histogram: values below 2^PEN_HISTOGRAM_SUB_BITS are exact,
+ * every following power of two is split into 2^(PEN_HISTOGRAM_SUB_BITS-1)
+ * linear buckets. Percentiles report the upper bound of their bucket, so
+ * they overstate by at most one bucket width, 1/16 or 6.25% of the value.
+ * Values are nanoseconds, anything above ~137s lands in the last bucket.
+ */
+#define PEN_HISTOGRAM_SUB_BITS 5
+#define PEN_HISTOGRAM_SUB_COUNT (1u << PEN_HISTOGRAM_SUB_BITS)
+#define PEN_HISTOGRAM_HALF_COUNT (PEN_HISTOGRAM_SUB_COUNT >> 1)
+#define PEN_HISTOGRAM_MAX_SHIFT 32
+#define PEN_HISTOGRAM_SIZE \
+    ((PEN_HISTOGRAM_MAX_SHIFT + 1) * PEN_HISTOGRAM_HALF_COUNT + PEN_HISTOGRAM_HALF_COUNT)
+
+typedef struct {
+    uint64_t count_;
+    uint64_t max_;
+    /* merged per thread and process histograms of long runs overflow 32 bits */
+    uint64_t buckets_[PEN_HISTOGRAM_SIZE];
+} pen_histogram_t;
+
+static inline uint64_t
+pen_histogram_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline unsigned
+pen_histogram_index(uint64_t value)
+{
+    unsigned shift;
+
+    if (value < PEN_HISTOGRAM_SUB_COUNT)
+        return (unsigned)value;
+
+    shift = 63 - __builtin_clzll(value) - PEN_HISTOGRAM_SUB_BITS + 1;
+    if (shift > PEN_HISTOGRAM_MAX_SHIFT)
+        return PEN_HISTOGRAM_SIZE - 1;
+    return shift * PEN_HISTOGRAM_HALF_COUNT + (unsigned)(value >> shift);
+}
+
+static inline void
+pen_histogram_record(pen_histogram_t *self, uint64_t value)
+{
+    self->buckets_[pen_histogram_index(value)]++;
+    self->count_++;
+    if (value > self->max_)
+        self->max_ = value;
+}
+
+void pen_histogram_reset(pen_histogram_t *self);
+void pen_histogram_merge(pen_histogram_t *self, const pen_histogram_t *other);
+uint64_t pen_histogram_percentile(const pen_histogram_t *self, double percent);
+void pen_histogram_print(const pen_histogram_t *self, const char *name);
+
+#endif /* PEN_HISTOGRAM_H */
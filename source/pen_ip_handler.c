@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2020  Linas <linas@justforfun.cn>
+ * Author: linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include <pen_socket/pen_socket.h>
+
+#include "pen_ip_handler.h"
+
+#define _STR(x) #x
+#define _SYMBOL(x) _STR(x)
+
+extern char **environ;
+
+static const char *arg_ = NULL;
+static void *plugin_ = NULL;
+
+static bool
+_save_arg(const char *arg)
+{
+    arg_ = arg;
+    return arg != NULL;
+}
+
+static inline void
+_ntop(uint32_t ip, char *buf)
+{
+    struct in_addr addr;
+
+    addr.s_addr = ip;
+    inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+/* exec: run arg with the address as its only parameter */
+static pid_t exec_pid = -1;
+
+static pen_ip_result_t
+_exec_update(uint32_t ip)
+{
+    char buf[INET_ADDRSTRLEN];
+    char *argv[3] = {(char*)arg_, buf, NULL};
+    int err;
+
+    _ntop(ip, buf);
+    err = posix_spawn(&exec_pid, arg_, NULL, NULL, argv, environ);
+    if (err != 0) {
+        PEN_ERROR("posix_spawn %s failed: %s", arg_, strerror(err));
+        exec_pid = -1;
+        return PEN_IP_FAILED;
+    }
+    return PEN_IP_RUNNING;
+}
+
+static pen_ip_result_t
+_exec_reap(void)
+{
+    int wstatus = 0;
+
+    if (exec_pid == -1)
+        return PEN_IP_FAILED;
+    if (waitpid(exec_pid, &wstatus, WNOHANG) <= 0)
+        return PEN_IP_RUNNING;
+    exec_pid = -1;
+
+    if (WIFEXITED(wstatus))
+        return WEXITSTATUS(wstatus) == 0 ? PEN_IP_DONE : PEN_IP_FAILED;
+    PEN_ERROR("%s failed with unknown status", arg_);
+    return PEN_IP_FAILED;
+}
+
+/* file: replace the content of arg with the address */
+static pen_ip_result_t
+_file_update(uint32_t ip)
+{
+    char tmp[PATH_MAX];
+    char buf[INET_ADDRSTRLEN + 1];
+    int fd, len;
+    bool ok;
+
+    _ntop(ip, buf);
+    len = strlen(buf);
+    buf[len++] = '\n';
+    snprintf(tmp, sizeof(tmp), "%s.tmp", arg_);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        PEN_ERROR("open %s failed: %s", tmp, strerror(errno));
+        return PEN_IP_FAILED;
+    }
+    ok = write(fd, buf, len) == len;
+    close(fd);
+    if (!ok || rename(tmp, arg_) != 0) {
+        PEN_ERROR("update %s failed: %s", arg_, strerror(errno));
+        return PEN_IP_FAILED;
+    }
+    return PEN_IP_DONE;
+}
+
+/* unix: send the address as one datagram to the socket at arg */
+static int unix_fd = -1;
+static struct sockaddr_un unix_addr;
+
+static bool
+_unix_init(const char *arg)
+{
+    if (!_save_arg(arg) || strlen(arg) >= sizeof(unix_addr.sun_path))
+        return false;
+
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    strcpy(unix_addr.sun_path, arg);
+
+    unix_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    return unix_fd >= 0;
+}
+
+static pen_ip_result_t
+_unix_update(uint32_t ip)
+{
+    char buf[INET_ADDRSTRLEN];
+
+    _ntop(ip, buf);
+    if (sendto(unix_fd, buf, strlen(buf), 0,
+               (struct sockaddr*)&unix_addr, sizeof(unix_addr)) < 0) {
+        PEN_ERROR("send to %s failed: %s", arg_, strerror(errno));
+        return PEN_IP_FAILED;
+    }
+    return PEN_IP_DONE;
+}
+
+static void
+_unix_destroy(void)
+{
+    if (unix_fd != -1)
+        close(unix_fd);
+    unix_fd = -1;
+}
+
+#ifdef __linux__
+/* route: point the route for arg (a.b.c.d/len) at the address */
+static int route_fd = -1;
+static uint32_t route_dst = 0;
+static uint8_t route_len = 32;
+
+static bool
+_route_init(const char *arg)
+{
+    char buf[INET_ADDRSTRLEN + 4];
+    char *slash;
+
+    if (!_save_arg(arg) || strlen(arg) >= sizeof(buf))
+        return false;
+
+    strcpy(buf, arg);
+    slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        route_len = atoi(slash + 1);
+    }
+    if (route_len > 32 || inet_pton(AF_INET, buf, &route_dst) != 1)
+        return false;
+
+    route_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    return route_fd >= 0;
+}
+
+static void
+_route_attr(struct nlmsghdr *nh, uint16_t type, const void *data, uint16_t len)
+{
+    struct rtattr *rta = (struct rtattr*)((char*)nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static pen_ip_result_t
+_route_update(uint32_t ip)
+{
+    struct {
+        struct nlmsghdr nh_;
+        struct rtmsg rt_;
+        char attrs_[64];
+    } req;
+    char reply[256];
+    struct nlmsghdr *nh = (struct nlmsghdr*)reply;
+    struct nlmsgerr *err;
+    ssize_t ret;
+
+    memset(&req, 0, sizeof(req));
+    req.nh_.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt_));
+    req.nh_.nlmsg_type = RTM_NEWROUTE;
+    req.nh_.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK;
+    req.rt_.rtm_family = AF_INET;
+    req.rt_.rtm_dst_len = route_len;
+    req.rt_.rtm_table = RT_TABLE_MAIN;
+    req.rt_.rtm_protocol = RTPROT_STATIC;
+    req.rt_.rtm_scope = RT_SCOPE_UNIVERSE;
+    req.rt_.rtm_type = RTN_UNICAST;
+    _route_attr(&req.nh_, RTA_DST, &route_dst, sizeof(route_dst));
+    _route_attr(&req.nh_, RTA_GATEWAY, &ip, sizeof(ip));
+
+    if (send(route_fd, &req, req.nh_.nlmsg_len, 0) < 0)
+        goto error;
+    ret = recv(route_fd, reply, sizeof(reply), 0);
+    if (ret < 0 || !NLMSG_OK(nh, (size_t)ret) || nh->nlmsg_type != NLMSG_ERROR)
+        goto error;
+
+    err = NLMSG_DATA(nh);
+    if (err->error == 0)
+        return PEN_IP_DONE;
+    errno = -err->error;
+error:
+    PEN_ERROR("update route %s failed: %s", arg_, strerror(errno));
+    return PEN_IP_FAILED;
+}
+
+static void
+_route_destroy(void)
+{
+    if (route_fd != -1)
+        close(route_fd);
+    route_fd = -1;
+}
+#endif
+
+static const pen_ip_handler_t builtins[] = {
+    {"exec", _save_arg, _exec_update, _exec_reap, NULL},
+    {"file", _save_arg, _file_update, NULL, NULL},
+    {"unix", _unix_init, _unix_update, NULL, _unix_destroy},
+#ifdef __linux__
+    {"route", _route_init, _route_update, NULL, _route_destroy},
+#endif
+};
+
+static const pen_ip_handler_t *
+_load_plugin(const char *path)
+{
+    const pen_ip_handler_t *handler;
+
+    plugin_ = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (plugin_ == NULL) {
+        PEN_ERROR("dlopen %s failed: %s", path, dlerror());
+        return NULL;
+    }
+
+    handler = dlsym(plugin_, _SYMBOL(PEN_IP_HANDLER_SYMBOL));
+    if (handler == NULL || handler->update_ == NULL) {
+        PEN_ERROR("%s does not export a valid handler", path);
+        dlclose(plugin_);
+        plugin_ = NULL;
+        return NULL;
+    }
+    return handler;
+}
+
+const pen_ip_handler_t *
+pen_ip_handler_load(const char *name, const char *arg)
+{
+    const pen_ip_handler_t *handler = NULL;
+
+    if (strchr(name, '/') != NULL) {
+        handler = _load_plugin(name);
+    } else {
+        for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+            if (strcmp(builtins[i].name_, name) == 0)
+                handler = &builtins[i];
+        }
+    }
+
+    if (handler == NULL) {
+        PEN_ERROR("unknown ip handler: %s", name);
+        return NULL;
+    }
+    if (handler->init_ != NULL && !handler->init_(arg)) {
+        PEN_ERROR("init ip handler %s failed", name);
+        pen_ip_handler_unload(handler);
+        return NULL;
+    }
+    return handler;
+}
+
+void
+pen_ip_handler_unload(const pen_ip_handler_t *handler)
+{
+    if (handler->destroy_ != NULL)
+        handler->destroy_();
+    if (plugin_ != NULL) {
+        dlclose(plugin_);
+        plugin_ = NULL;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2020  Linas <linas@justforfun.cn>
+ * Author: linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_IP_HANDLER_H
+#define PEN_IP_HANDLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    PEN_IP_DONE,
+    PEN_IP_FAILED,
+    PEN_IP_RUNNING,
+} pen_ip_result_t;
+
+/*
+ * Reacts to a new address of the server side, `ip` is in network order.
+ * update_ may finish later by returning PEN_IP_RUNNING, reap_ is then
+ * called on every SIGCHLD until it stops returning PEN_IP_RUNNING.
+ *
+ * A plugin is a shared object exporting
+ *     const pen_ip_handler_t PEN_IP_HANDLER_SYMBOL;
+ */
+typedef struct {
+    const char *name_;
+    bool (*init_)(const char *arg);
+    pen_ip_result_t (*update_)(uint32_t ip);
+    pen_ip_result_t (*reap_)(void);
+    void (*destroy_)(void);
+} pen_ip_handler_t;
+
+#define PEN_IP_HANDLER_SYMBOL pen_ip_handler
+
+/* `name` is a built-in (exec, file, unix, route) or the path of a plugin */
+const pen_ip_handler_t *pen_ip_handler_load(const char *name, const char *arg);
+void pen_ip_handler_unload(const pen_ip_handler_t *handler);
+
+#endif /* PEN_IP_HANDLER_H */
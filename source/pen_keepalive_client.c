@@ -17,7 +17,9 @@
  */
 #include <signal.h>
 #include <stdio.h>
-#include <sys/wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include <pen_utils/pen_options.h>
 #include <pen_utils/pen_profile.h>
@@ -25,29 +27,77 @@
 #include <pen_socket/pen_signal.h>
 #include <pen_socket/pen_socket.h>
 #include <pen_socket/pen_timer.h>
-#include <pen_crypt/pen_aes.h>
+
+#include "pen_frame.h"
+#include "pen_histogram.h"
+#include "pen_ip_handler.h"
+#include "pen_loop.h"
 
 #define PEN_CMD "/data/usr/bin/pen_update_ip"
+#define PEN_RETRY_MIN 1000
+#define PEN_RETRY_MAX 60000
+#define PEN_CONNECT_MIN 100
+#define PEN_CONNECT_MAX 30000
+
+typedef struct {
+    pen_event_base_t eb_;
+    const char *host_;
+    uint16_t port_;
+    bool connected_;
+    bool has_ip_;
+    uint16_t missed_;
+    uint32_t srtt_;
+    uint32_t backoff_;
+    uint32_t ip_;
+    pen_event_base_t *timer_;
+    pen_frame_ctx_t frame_;
+} pen_server_t;
 
 static bool running = true;
+static const char *command = PEN_CMD;
+static const char *handler_name = "exec";
+static const char *handler_arg = NULL;
+static const pen_ip_handler_t *handler = NULL;
 static const char *host = "127.0.0.1";
 static const char *passwd = NULL;
 static uint16_t port = 1234;
+static uint32_t client_id = 0;
+static const char *standby = NULL;
+static uint16_t standby_port = 1234;
+static uint16_t heartbeat = 200;
+static uint16_t misses = 3;
 static pen_event_t ev = NULL;
-static pen_event_base_t *timer = NULL;
-static pen_crypt_t enkey = NULL;
-static pen_crypt_t dekey = NULL;
+static pen_frame_key_t key = NULL;
+static pen_server_t servers[2];
+static uint16_t server_num = 0;
+static pen_server_t *active = NULL;
+static pen_event_base_t *heartbeat_timer = NULL;
+static pen_event_base_t *hook_timer = NULL;
+static bool hook_busy = false;
+static uint32_t hook_ip = 0;
+static uint32_t hook_delay = 0;
+static bool hook_pending = false;
+static bool hook_retry = false;
 
 static inline bool
 _init_profile(const char *profile)
 {
 #define _s(a,b,d) PEN_OPTIONS_ITEM(PEN_OPTION_STRING, a, b, d)
 #define _i(a,b,d) PEN_OPTIONS_ITEM(PEN_OPTION_UINT16, a, b, d)
+#define _li(a,b,d) PEN_OPTIONS_ITEM(PEN_OPTION_UINT32, a, b, d)
 
     pen_option_t opts[] = {
         _s(server, host, "server(define 127.0.0.1)")
         _i(port, port, "port(default 1234)")
+        _li(id, client_id, "id this client reports its address for, not 0")
+        _s(standby, standby, "hot standby server(default NULL)")
+        _i(standby_port, standby_port, "port of the standby server(default 1234)")
+        _i(heartbeat, heartbeat, "heartbeat interval in ms, 0 to disable(default 200)")
+        _i(misses, misses, "missed heartbeats before a server is dead(default 3)")
         _s(password, passwd, "password")
+        _s(handler, handler_name, "exec, file, unix, route or a plugin path(default exec)")
+        _s(handler_arg, handler_arg, "argument of the handler(default NULL)")
+        _s(command, command, "command of the exec handler(default " PEN_CMD ")")
         _s(log_info, __pen_log_filename, "log info file name(default NULL)")
         _s(log_err, __pen_err_filename, "log error file name(default NULL)")
     };
@@ -55,6 +105,7 @@ _init_profile(const char *profile)
     return pen_profile_init(profile, opts, sizeof(opts) / sizeof(opts[0]));
 #undef _s
 #undef _i
+#undef _li
 }
 
 static inline bool
@@ -62,8 +113,10 @@ _init_options(int argc, char *argv[])
 {
     const char *profile = NULL;
 #define _s(a,b,d) PEN_OPTIONS_ITEM(PEN_OPTION_STRING, a, b, d)
+#define _i(a,b,d) PEN_OPTIONS_ITEM(PEN_OPTION_UINT16, a, b, d)
     pen_option_t opts[] = {
         _s(--config, profile, "")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
     };
 
     PEN_OPTIONS_INIT(argc, argv, opts);
@@ -71,132 +124,280 @@ _init_options(int argc, char *argv[])
         return false;
 
     return _init_profile(profile);
+#undef _i
 #undef _s
 }
 
+static void _on_hook_result(pen_ip_result_t);
+
 static void
-_on_close(pen_event_base_t *eb)
+_retry_hook(void)
 {
-    PEN_INFO("on close");
-    close(eb->fd_);
-    eb->fd_ = PEN_INVALID_SOCK;
-    pen_timer_settime_once(timer, 1000);
+    hook_delay = hook_delay == 0 ? PEN_RETRY_MIN : hook_delay * 2;
+    if (hook_delay > PEN_RETRY_MAX)
+        hook_delay = PEN_RETRY_MAX;
+
+    PEN_WARN("run %s handler again in %u ms.", handler->name_, hook_delay);
+    hook_retry = true;
+    pen_timer_settime_once(hook_timer, hook_delay);
 }
 
-static bool
-_on_ip_changed(uint32_t ip)
+/* never blocks, handlers that need more time finish through SIGCHLD */
+static void
+_run_hook(void)
 {
-    struct in_addr addr;
-    int pid, wstatus = 0;
-
-    addr.s_addr = ip;
-    pid = fork();
-    if (pid == -1) {
-        PEN_ERROR("fork failed.");
-        exit(1);
+    if (hook_busy) {
+        hook_pending = true;
+        return;
     }
-    if (pid == 0) {
-        if (execl(PEN_CMD, PEN_CMD, inet_ntoa(addr), NULL) == -1) {
-            PEN_ERROR("execl failed.");
-            exit(1);
-        }
+
+    hook_retry = false;
+    _on_hook_result(handler->update_(hook_ip));
+}
+
+static void
+_on_hook_result(pen_ip_result_t ret)
+{
+    hook_busy = ret == PEN_IP_RUNNING;
+    if (hook_busy)
+        return;
+
+    if (hook_pending) {
+        hook_pending = false;
+        hook_delay = 0;
+        return _run_hook();
     }
-    if (waitpid(pid, &wstatus, 0) == -1) {
-        PEN_ERROR("waitpid failed");
-        exit(1);
+
+    if (ret == PEN_IP_DONE)
+        hook_delay = 0;
+    else
+        _retry_hook();
+}
+
+static void
+_on_ip_changed(uint32_t ip)
+{
+    hook_ip = ip;
+    hook_delay = 0;
+    _run_hook();
+}
+
+static void
+_on_child(int sig PEN_UNUSED)
+{
+    if (hook_busy && handler->reap_ != NULL)
+        _on_hook_result(handler->reap_());
+}
+
+static void
+_on_hook_timer(void *user PEN_UNUSED)
+{
+    if (hook_retry)
+        _run_hook();
+}
+
+/* the first ready server in profile order, the standby only while the main one is down */
+static void
+_select_active(void)
+{
+    pen_server_t *best = NULL;
+
+    for (uint16_t i = 0; i < server_num; i++) {
+        if (servers[i].eb_.fd_ != PEN_INVALID_SOCK && servers[i].frame_.peer_ != 0) {
+            best = &servers[i];
+            break;
+        }
     }
-    if (!WIFEXITED(wstatus)) {
-        PEN_ERROR("execl failed with unknown status");
-        return false;
+    if (best == active)
+        return;
+
+    active = best;
+    if (best == NULL) {
+        PEN_WARN("no server available.");
+        return;
     }
+    PEN_INFO("use server %s:%u, srtt %u us.", best->host_, best->port_, best->srtt_);
+    if (best->has_ip_ && best->ip_ != hook_ip)
+        _on_ip_changed(best->ip_);
+}
+
+static void
+_on_close(pen_event_base_t *eb)
+{
+    pen_server_t *self = (pen_server_t*)eb;
+    uint32_t delay;
 
-    wstatus = WEXITSTATUS(wstatus);
-    return wstatus == 0;
+    PEN_INFO("on close: %s", self->host_);
+    close(eb->fd_);
+    eb->fd_ = PEN_INVALID_SOCK;
+
+    /* exponential backoff, jittered so clients do not come back in lockstep */
+    self->backoff_ = self->backoff_ == 0 ? PEN_CONNECT_MIN : self->backoff_ * 2;
+    if (self->backoff_ > PEN_CONNECT_MAX)
+        self->backoff_ = PEN_CONNECT_MAX;
+    delay = self->backoff_ / 2 + rand() % (self->backoff_ / 2 + 1);
+    pen_timer_settime_once(self->timer_, delay);
+
+    _select_active();
 }
 
-static inline void
-_send_auth_data(pen_event_base_t *eb)
+static bool
+_send_frame(pen_server_t *self, uint8_t type, const void *data, uint16_t len)
 {
-    pen_aes_data_t data;
-    data.llu_[0] = time(NULL);
-    data.u_[2] = 0x1c2b8695;
-    data.u_[3] = 0;
+    uint8_t buf[PEN_FRAME_BUF];
+    size_t size = pen_frame_seal(&self->frame_, key, type, data, len, buf);
 
-    pen_crypt_aes_encrypt(enkey, &data);
-    pen_assert2(write(eb->fd_, (void*)&data, sizeof(data)) == sizeof(data));
+    return size > 0 && write(self->eb_.fd_, buf, size) == (ssize_t)size;
 }
 
 static bool
-_on_write(pen_event_base_t *eb)
+_on_write(pen_server_t *self)
 {
-    if (eb->user_ == NULL) {
-        PEN_INFO("connect to server.");
-        pen_assert2(pen_set_keepalive(eb->fd_, 3, 60, 20));
-        _send_auth_data(eb);
-        eb->user_ = (void*)1;
+    if (!self->connected_) {
+        PEN_INFO("connect to server %s.", self->host_);
+        pen_assert2(pen_set_keepalive(self->eb_.fd_, 3, 60, 20));
+        self->connected_ = true;
+        return _send_frame(self, PEN_FRAME_HELLO, NULL, 0);
     }
     return true;
 }
 
+static void
+_on_pong(pen_server_t *self, const pen_frame_t *f)
+{
+    uint64_t sent;
+    uint32_t rtt;
+
+    if (f->len_ != sizeof(sent))
+        return;
+    memcpy(&sent, f->data_, sizeof(sent));
+    rtt = (pen_histogram_now() - sent) / 1000;
+    self->srtt_ = self->srtt_ == 0 ? rtt : (self->srtt_ * 7 + rtt) / 8;
+}
+
+static bool
+_on_frame(pen_server_t *self, const pen_frame_t *f)
+{
+    uint8_t id[4];
+    uint16_t off;
+
+    self->missed_ = 0;
+    switch (f->type_) {
+    case PEN_FRAME_HELLO:
+        self->backoff_ = 0;
+        pen_frame_put32(id, client_id);
+        if (!_send_frame(self, PEN_FRAME_AUTH, id, sizeof(id)))
+            return false;
+        _select_active();
+        return true;
+    case PEN_FRAME_PING:
+        return _send_frame(self, PEN_FRAME_PONG, f->data_, f->len_);
+    case PEN_FRAME_PONG:
+        _on_pong(self, f);
+        return true;
+    case PEN_FRAME_IP:
+        break;
+    default:
+        return false;
+    }
+
+    if (f->len_ == 0 || f->len_ % 8 != 0)
+        return false;
+
+    /* only our own id matters, the newest entry wins */
+    for (off = f->len_; off > 0; off -= 8) {
+        if (pen_frame_get32(f->data_ + off - 8) == client_id)
+            break;
+    }
+    if (off == 0)
+        return true;
+    memcpy(&self->ip_, f->data_ + off - 4, sizeof(self->ip_));
+    self->has_ip_ = true;
+    if (self == active)
+        _on_ip_changed(self->ip_);
+    return true;
+}
+
 static void
 _on_event(pen_event_base_t *eb, uint16_t pe)
 {
-    uint64_t buf[3];
-    pen_aes_data_t *data;
+    pen_server_t *self = (pen_server_t*)eb;
+    pen_frame_t f;
+    ssize_t ret;
 
     if (pe == PEN_EVENT_CLOSE)
         return _on_close(eb);
 
-    if (pe & PEN_EVENT_WRITE)
-        _on_write(eb);
+    if ((pe & PEN_EVENT_WRITE) && !_on_write(self))
+        goto error;
 
     if ((pe & PEN_EVENT_READ) == 0)
         return;
 
-    int ret = read(eb->fd_, buf, sizeof(buf));
-    if (ret == 0)
-        goto error;
-    if (ret != sizeof(uint64_t) * 2) {
-        PEN_WARN("unknown data received!");
-        goto error;
-    }
-    data = (pen_aes_data_t*)buf;
-    pen_crypt_aes_decrypt(dekey, data);
-    if (data->u_[2] != 0)
+    ret = pen_frame_recv(&self->frame_, eb->fd_);
+    if (ret == 0 || (ret < 0 && errno != EAGAIN))
         goto error;
 
-    while (!_on_ip_changed(data->u_[3]))
-        sleep(1);
-    return;
+    while ((ret = pen_frame_next(&self->frame_, key, &f)) > 0) {
+        if (!_on_frame(self, &f))
+            goto error;
+    }
+    if (ret == 0)
+        return;
+    PEN_WARN("bad frame from server %s!", self->host_);
 error:
     _on_close(eb);
 }
 
+PEN_LOOP_TIMED(_on_event)
+
 static void
-_stop_connector(pen_event_base_t *eb)
+_stop_connector(pen_server_t *self)
 {
-    if (eb->fd_ != PEN_INVALID_SOCK) {
-        close(eb->fd_);
-        eb->fd_ = PEN_INVALID_SOCK;
+    if (self->eb_.fd_ != PEN_INVALID_SOCK) {
+        close(self->eb_.fd_);
+        self->eb_.fd_ = PEN_INVALID_SOCK;
     }
 }
 
 static void
-_start_connector(pen_event_base_t *eb)
+_start_connector(pen_server_t *self)
 {
-    PEN_INFO("start connector.");
-    memset(eb, 0, sizeof(*eb));
-    pen_assert2(pen_connect_tcp(eb, host, port));
+    pen_event_base_t *eb = &self->eb_;
 
-    pen_assert2(pen_set_sockopt(eb->fd_, SO_RCVLOWAT, sizeof(uint64_t) * 2));
-    pen_assert2(pen_set_sockopt(eb->fd_, SO_RCVBUF, sizeof(uint64_t) * 3));
-    pen_assert2(pen_set_sockopt(eb->fd_, SO_SNDBUF, sizeof(uint64_t) * 3));
+    PEN_INFO("start connector: %s.", self->host_);
+    memset(eb, 0, sizeof(*eb));
+    pen_assert2(pen_connect_tcp(eb, self->host_, self->port_));
+    pen_frame_init(&self->frame_);
+    self->connected_ = false;
+    self->missed_ = 0;
 
-    eb->on_event_ = _on_event;
+    eb->on_event_ = _on_event_timed;
 
     pen_assert2(pen_event_add_rw(ev, eb));
 }
 
+/* tcp keepalive takes minutes, a few silent intervals are enough here */
+static void
+_on_heartbeat(void *user PEN_UNUSED)
+{
+    uint64_t now = pen_histogram_now();
+    pen_server_t *self;
+
+    for (uint16_t i = 0; i < server_num; i++) {
+        self = &servers[i];
+        if (self->eb_.fd_ == PEN_INVALID_SOCK)
+            continue;
+        if (self->missed_++ >= misses) {
+            PEN_WARN("heartbeat lost: %s, srtt %u us.", self->host_, self->srtt_);
+            _on_close(&self->eb_);
+        } else if (self->frame_.peer_ != 0
+                   && !_send_frame(self, PEN_FRAME_PING, &now, sizeof(now))) {
+            _on_close(&self->eb_);
+        }
+    }
+}
+
 static void
 _on_signal(int sig PEN_UNUSED)
 {
@@ -207,34 +408,35 @@ _on_signal(int sig PEN_UNUSED)
 static void
 _on_timer(void *user)
 {
-    _start_connector((pen_event_base_t*)user);
+    _start_connector((pen_server_t*)user);
 }
 
-static void
-start_server(void)
+static bool
+_keep_running(void *user PEN_UNUSED)
 {
-    int ret = 0;
-
-    do {
-        fflush(NULL);
-        ret = pen_event_wait(ev, -1);
-    } while (running && ret >= 0);
+    return running;
 }
 
 int
 main(int argc, char *argv[])
 {
-    pen_event_base_t conn;
-
     _init_options(argc, argv);
 
     pen_assert2(pen_log_init());
     pen_assert2(passwd != NULL);
+    if (client_id == 0) {
+        PEN_ERROR("the profile needs a non zero id.");
+        return 1;
+    }
+    srand(time(NULL) ^ getpid());
 
-    enkey = pen_crypt_aes_encrypt_init((uint8_t*)passwd);
-    pen_assert2(enkey != NULL);
-    dekey = pen_crypt_aes_decrypt_init((uint8_t*)passwd);
-    pen_assert2(dekey != NULL);
+    key = pen_frame_key_init(passwd);
+    pen_assert2(key != NULL);
+
+    if (handler_arg == NULL && strcmp(handler_name, "exec") == 0)
+        handler_arg = command;
+    handler = pen_ip_handler_load(handler_name, handler_arg);
+    pen_assert2(handler != NULL);
 
     ev = pen_event_init(8);
     pen_assert2(ev != NULL);
@@ -242,20 +444,42 @@ main(int argc, char *argv[])
     pen_assert2(pen_signal_init(ev));
     pen_assert2(pen_signal(SIGTERM, _on_signal));
     pen_assert2(pen_signal(SIGINT, _on_signal));
+    pen_assert2(pen_signal(SIGCHLD, _on_child));
+
+    hook_timer = pen_timer_init(ev, _on_hook_timer, NULL);
+    pen_assert2(hook_timer != NULL);
 
-    timer = pen_timer_init(ev, _on_timer, &conn);
-    pen_assert2(timer != NULL);
+    servers[server_num].host_ = host;
+    servers[server_num++].port_ = port;
+    if (standby != NULL) {
+        servers[server_num].host_ = standby;
+        servers[server_num++].port_ = standby_port;
+    }
+    for (uint16_t i = 0; i < server_num; i++) {
+        servers[i].timer_ = pen_timer_init(ev, _on_timer, &servers[i]);
+        pen_assert2(servers[i].timer_ != NULL);
+        _start_connector(&servers[i]);
+    }
 
-    _start_connector(&conn);
+    if (heartbeat > 0) {
+        heartbeat_timer = pen_timer_init(ev, _on_heartbeat, NULL);
+        pen_assert2(heartbeat_timer != NULL);
+        pen_timer_settime(heartbeat_timer, heartbeat);
+    }
 
-    start_server();
+    pen_loop_run("keepalive_client", ev, -1, true, _keep_running, NULL);
 
-    pen_timer_destroy(timer);
-    _stop_connector(&conn);
+    if (heartbeat_timer != NULL)
+        pen_timer_destroy(heartbeat_timer);
+    for (uint16_t i = 0; i < server_num; i++) {
+        pen_timer_destroy(servers[i].timer_);
+        _stop_connector(&servers[i]);
+    }
+    pen_timer_destroy(hook_timer);
     pen_signal_destroy();
     pen_event_destroy(ev);
-    pen_crypt_aes_destroy(enkey);
-    pen_crypt_aes_destroy(dekey);
+    pen_frame_key_destroy(key);
+    pen_ip_handler_unload(handler);
     pen_log_destroy();
     return 0;
 }
@@ -17,41 +17,124 @@
  */
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 
 #include <pen_utils/pen_options.h>
 #include <pen_utils/pen_profile.h>
-#include <pen_utils/pen_memory_pool.h>
 #include <pen_socket/pen_event.h>
 #include <pen_socket/pen_listener.h>
 #include <pen_socket/pen_signal.h>
 #include <pen_socket/pen_socket.h>
-#include <pen_crypt/pen_aes.h>
-
-typedef struct {
+#include <pen_socket/pen_timer.h>
+
+#include "pen_frame.h"
+#include "pen_histogram.h"
+#include "pen_loop.h"
+#include "pen_state.h"
+#include "pen_stats.h"
+
+#define PEN_OUT_SIZE 256
+
+enum {
+    PEN_STAT_ACTIVE,
+    PEN_STAT_ACCEPTS,
+    PEN_STAT_AUTHS,
+    PEN_STAT_WATCHES,
+    PEN_STAT_BAD_FRAMES,
+    PEN_STAT_CHANGES,
+    PEN_STAT_HEARTBEAT_LOST,
+    PEN_STAT_BYTES_IN,
+    PEN_STAT_BYTES_OUT,
+    PEN_STAT_NUM,
+};
+
+static const pen_stats_desc_t stat_descs[PEN_STAT_NUM] = {
+    {"connections", "open client connections", true},
+    {"accepts_total", "accepted connections", false},
+    {"auths_total", "auth requests", false},
+    {"watches_total", "watch requests", false},
+    {"bad_frames_total", "frames failing to parse or authenticate", false},
+    {"ip_changes_total", "addresses changed", false},
+    {"heartbeat_lost_total", "clients dropped for missed heartbeats", false},
+    {"bytes_in_total", "bytes received", false},
+    {"bytes_out_total", "bytes sent", false},
+};
+
+typedef struct pen_client_s pen_client_t;
+typedef struct pen_track_s pen_track_t;
+
+struct pen_client_s {
     pen_event_base_t eb_;
     uint32_t ip_;
-} pen_client_t;
+    pen_track_t *track_;
+    pen_track_t *watch_;
+    pen_client_t *prev_;
+    pen_client_t *next_;
+    pen_client_t *live_prev_;
+    pen_client_t *live_next_;
+    uint16_t missed_;
+    uint32_t srtt_;
+    uint16_t out_len_;
+    uint16_t out_off_;
+    uint16_t out_last_;
+    pen_frame_ctx_t frame_;
+    uint8_t out_[PEN_OUT_SIZE];
+};
+
+/* what we know about one id, never freed */
+struct pen_track_s {
+    uint32_t id_;
+    uint32_t ip_;
+    bool known_;
+    pen_client_t *owner_;
+    pen_client_t *subs_;
+};
+
+/* open addressing, linear probing, ids are never removed */
+typedef struct {
+    pen_track_t **slots_;
+    uint32_t mask_;
+    uint32_t size_;
+} pen_track_table_t;
 
 static const char *profile = NULL;
 static bool running = true;
 static uint16_t port = 1234;
+static uint16_t chunk_size = 64;
 static const char *passwd = NULL;
-static pen_memory_pool_t pool = NULL;
-static pen_crypt_t enkey = NULL;
-static pen_crypt_t dekey = NULL;
-#define MAX_CLIENT_NUMBER 1
-static pen_client_t *clients[MAX_CLIENT_NUMBER];
+static pen_event_t ev = NULL;
+static pen_client_t *free_clients = NULL;
+static pen_track_t *free_tracks = NULL;
+static uint16_t track_left = 0;
+static void **chunks = NULL;
+static uint32_t chunk_num = 0;
+static pen_frame_key_t key = NULL;
+static pen_track_table_t tracks;
+static const char *state_file = NULL;
+static pen_state_t state = NULL;
+static pen_client_t *live_clients = NULL;
+static pen_event_base_t *heartbeat_timer = NULL;
+static uint16_t heartbeat = 200;
+static uint16_t misses = 3;
+static uint16_t stats_port = 0;
+static uint16_t stats_dump = 0;
+static pen_stats_t stats = NULL;
+static pen_stats_block_t *counters = NULL;
 
 static inline void
 _init_options(int argc, char *argv[])
 {
 #define _s(a,b,d) PEN_OPTIONS_ITEM(PEN_OPTION_STRING, a, b, d)
+#define _i(a,b,d) PEN_OPTIONS_ITEM(PEN_OPTION_UINT16, a, b, d)
 
     pen_option_t opts[] = {
         _s(--config, profile, "profile file name(default NULL)")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
     };
 
     PEN_OPTIONS_INIT(argc, argv, opts);
+#undef _i
 #undef _s
 }
 
@@ -65,7 +148,13 @@ _init_profile(void)
 
     pen_option_t opts[] = {
         _i(port, port, "port(default 1234)")
+        _i(pool, chunk_size, "clients allocated at once(default 64)")
         _s(password, passwd, "password")
+        _s(state, state_file, "file keeping known addresses across restarts(default NULL)")
+        _i(heartbeat, heartbeat, "heartbeat interval in ms, 0 to disable(default 200)")
+        _i(misses, misses, "missed heartbeats before a client is dropped(default 3)")
+        _i(stats_port, stats_port, "port of the stats listener, 0 to disable(default 0)")
+        _i(stats_dump, stats_dump, "seconds between stats in the log, 0 to disable(default 0)")
         _s(log_info, __pen_log_filename, "log info file name(default NULL)")
         _s(log_err, __pen_err_filename, "log error file name(default NULL)")
     };
@@ -75,6 +164,120 @@ _init_profile(void)
 #undef _s
 }
 
+static void *
+_chunk_new(size_t size)
+{
+    void *chunk = calloc(chunk_size, size);
+
+    pen_assert2(chunk != NULL);
+    chunks = realloc(chunks, sizeof(void*) * (chunk_num + 1));
+    pen_assert2(chunks != NULL);
+    chunks[chunk_num++] = chunk;
+    return chunk;
+}
+
+static pen_client_t *
+_client_get(void)
+{
+    pen_client_t *self;
+
+    if (free_clients == NULL) {
+        self = _chunk_new(sizeof(pen_client_t));
+        for (uint16_t i = 0; i < chunk_size; i++) {
+            self[i].next_ = free_clients;
+            free_clients = &self[i];
+        }
+    }
+
+    self = free_clients;
+    free_clients = self->next_;
+    memset(self, 0, sizeof(*self));
+    return self;
+}
+
+static inline void
+_client_put(pen_client_t *self)
+{
+    self->next_ = free_clients;
+    free_clients = self;
+}
+
+static pen_track_t *
+_track_new(uint32_t id)
+{
+    pen_track_t *self;
+
+    if (track_left == 0) {
+        free_tracks = _chunk_new(sizeof(pen_track_t));
+        track_left = chunk_size;
+    }
+    self = free_tracks++;
+    track_left--;
+    self->id_ = id;
+    if (state != NULL)
+        self->known_ = pen_state_get(state, id, &self->ip_);
+    return self;
+}
+
+static inline uint32_t
+_track_hash(uint32_t id)
+{
+    id ^= id >> 16;
+    id *= 0x45d9f3b;
+    id ^= id >> 16;
+    return id;
+}
+
+static pen_track_t **
+_track_slot(pen_track_table_t *table, uint32_t id)
+{
+    uint32_t i = _track_hash(id) & table->mask_;
+
+    while (table->slots_[i] != NULL && table->slots_[i]->id_ != id)
+        i = (i + 1) & table->mask_;
+    return &table->slots_[i];
+}
+
+static void
+_track_table_init(pen_track_table_t *table, uint32_t capacity)
+{
+    table->slots_ = calloc(capacity, sizeof(pen_track_t*));
+    pen_assert2(table->slots_ != NULL);
+    table->mask_ = capacity - 1;
+    table->size_ = 0;
+}
+
+static void
+_track_table_grow(pen_track_table_t *table)
+{
+    pen_track_table_t bigger;
+
+    _track_table_init(&bigger, (table->mask_ + 1) * 2);
+    for (uint32_t i = 0; i <= table->mask_; i++) {
+        if (table->slots_[i] != NULL)
+            *_track_slot(&bigger, table->slots_[i]->id_) = table->slots_[i];
+    }
+    bigger.size_ = table->size_;
+    free(table->slots_);
+    *table = bigger;
+}
+
+static pen_track_t *
+_track_get(uint32_t id)
+{
+    pen_track_t **slot = _track_slot(&tracks, id);
+
+    if (*slot != NULL)
+        return *slot;
+
+    *slot = _track_new(id);
+    if (++tracks.size_ * 4 > (tracks.mask_ + 1) * 3) {
+        _track_table_grow(&tracks);
+        slot = _track_slot(&tracks, id);
+    }
+    return *slot;
+}
+
 static void
 _on_close(pen_event_base_t *eb)
 {
@@ -82,80 +285,290 @@ _on_close(pen_event_base_t *eb)
 
     PEN_INFO("client closed: %s", pen_ntop(&self->ip_));
     eb->fd_ = -1;
+    pen_stats_sub(counters, PEN_STAT_ACTIVE, 1);
+
+    if (self->live_prev_ != NULL)
+        self->live_prev_->live_next_ = self->live_next_;
+    else
+        live_clients = self->live_next_;
+    if (self->live_next_ != NULL)
+        self->live_next_->live_prev_ = self->live_prev_;
+
+    if (self->track_ != NULL && self->track_->owner_ == self)
+        self->track_->owner_ = NULL;
+    if (self->watch_ != NULL) {
+        if (self->prev_ != NULL)
+            self->prev_->next_ = self->next_;
+        else
+            self->watch_->subs_ = self->next_;
+        if (self->next_ != NULL)
+            self->next_->prev_ = self->prev_;
+    }
+    _client_put(self);
+}
+
+static void
+_flush_client(pen_client_t *self)
+{
+    size_t size = self->out_len_ - self->out_off_;
+    ssize_t ret;
+
+    ret = send(self->eb_.fd_, self->out_ + self->out_off_, size,
+               MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0) {
+        if (errno == EAGAIN)
+            return;
+        close(self->eb_.fd_);
+        return _on_close(&self->eb_);
+    }
+
+    pen_stats_add(counters, PEN_STAT_BYTES_OUT, ret);
+    if ((size_t)ret < size) {
+        self->out_off_ += ret;
+        return;
+    }
+    self->out_len_ = 0;
+    self->out_off_ = 0;
+    self->out_last_ = 0;
+    pen_assert2(pen_event_mod_r(ev, &self->eb_));
+}
+
+/* queue a frame and let write readiness flush it */
+static void
+_queue_frame(pen_client_t *self, uint8_t type, const void *data, uint16_t len)
+{
+    uint8_t frame[PEN_FRAME_BUF];
+    size_t size = pen_frame_seal(&self->frame_, key, type, data, len, frame);
+    bool empty = self->out_len_ == 0;
+
+    if (size == 0)
+        goto error;
+
+    if (self->out_off_ > 0) {
+        memmove(self->out_, self->out_ + self->out_off_, self->out_len_ - self->out_off_);
+        self->out_len_ -= self->out_off_;
+        if (self->out_last_ < self->out_off_)
+            self->out_last_ = self->out_len_;
+        else
+            self->out_last_ -= self->out_off_;
+        self->out_off_ = 0;
+    }
+
+    /* only the latest address matters, drop an update nobody started on */
+    if (self->out_len_ + size > sizeof(self->out_))
+        self->out_len_ = self->out_last_;
+    if (self->out_len_ + size > sizeof(self->out_))
+        goto error;
+
+    memcpy(self->out_ + self->out_len_, frame, size);
+    self->out_last_ = type == PEN_FRAME_IP ? self->out_len_ : self->out_len_ + size;
+    self->out_len_ += size;
+
+    if (empty)
+        pen_assert2(pen_event_mod_rw(ev, &self->eb_));
+    return;
+error:
+    PEN_WARN("drop client: %s", pen_ntop(&self->ip_));
+    close(self->eb_.fd_);
+    _on_close(&self->eb_);
 }
 
 static inline void
-_on_client_ip_changed(pen_client_t *self)
+_queue_ip(pen_client_t *self, const pen_track_t *track)
+{
+    uint8_t data[8];
+
+    pen_frame_put32(data, track->id_);
+    memcpy(data + 4, &track->ip_, sizeof(track->ip_));
+    _queue_frame(self, PEN_FRAME_IP, data, sizeof(data));
+}
+
+static void
+_on_track_changed(pen_track_t *track, pen_client_t *self)
+{
+    pen_client_t *sub, *next;
+
+    /* every connection has its own session, seal one frame per peer */
+    if (self != NULL)
+        _queue_ip(self, track);
+    for (sub = track->subs_; sub != NULL; sub = next) {
+        next = sub->next_;
+        _queue_ip(sub, track);
+    }
+}
+
+static void
+_on_auth(pen_client_t *self, pen_track_t *track)
 {
-    pen_aes_data_t data;
-    data.llu_[0] = time(NULL);
-    data.u_[2] = 0;
-    data.u_[3] = self->ip_;
+    pen_client_t *last = track->owner_;
+
+    self->track_ = track;
+    track->owner_ = self;
+    if (last != NULL) {
+        close(last->eb_.fd_);
+        _on_close(&last->eb_);
+    }
 
-    pen_crypt_aes_encrypt(enkey, &data);
-    pen_assert2(write(self->eb_.fd_, &data, sizeof(data)) == sizeof(data));
+    if (!track->known_ || track->ip_ != self->ip_) {
+        track->known_ = true;
+        track->ip_ = self->ip_;
+        pen_stats_add(counters, PEN_STAT_CHANGES, 1);
+        if (state != NULL && !pen_state_set(state, track->id_, track->ip_))
+            PEN_WARN("can not save the address of %u", track->id_);
+        _on_track_changed(track, self);
+    }
+}
+
+static void
+_on_watch(pen_client_t *self, pen_track_t *track)
+{
+    self->watch_ = track;
+    self->next_ = track->subs_;
+    if (track->subs_ != NULL)
+        track->subs_->prev_ = self;
+    track->subs_ = self;
+
+    if (track->known_)
+        _queue_ip(self, track);
+}
+
+static void
+_on_pong(pen_client_t *self, const pen_frame_t *frame)
+{
+    uint64_t sent;
+    uint32_t rtt;
+
+    if (frame->len_ != sizeof(sent))
+        return;
+    memcpy(&sent, frame->data_, sizeof(sent));
+    rtt = (pen_histogram_now() - sent) / 1000;
+    self->srtt_ = self->srtt_ == 0 ? rtt : (self->srtt_ * 7 + rtt) / 8;
+}
+
+static bool
+_on_frame(pen_client_t *self, const pen_frame_t *frame)
+{
+    pen_track_t *track;
+
+    self->missed_ = 0;
+    if (frame->type_ == PEN_FRAME_HELLO)
+        return true;
+    if (frame->type_ == PEN_FRAME_PING) {
+        _queue_frame(self, PEN_FRAME_PONG, frame->data_, frame->len_);
+        return true;
+    }
+    if (frame->type_ == PEN_FRAME_PONG) {
+        _on_pong(self, frame);
+        return true;
+    }
+    if (self->track_ != NULL || self->watch_ != NULL || frame->len_ != 4)
+        return false;
+    /* 0 is what unconfigured clients used to send, it is nobody */
+    if (pen_frame_get32(frame->data_) == 0)
+        return false;
+
+    track = _track_get(pen_frame_get32(frame->data_));
+    if (frame->type_ == PEN_FRAME_AUTH) {
+        pen_stats_add(counters, PEN_STAT_AUTHS, 1);
+        _on_auth(self, track);
+    } else if (frame->type_ == PEN_FRAME_WATCH) {
+        pen_stats_add(counters, PEN_STAT_WATCHES, 1);
+        _on_watch(self, track);
+    } else {
+        return false;
+    }
+    return true;
 }
 
 static void
 _on_event(pen_event_base_t *eb, uint16_t pe)
 {
-    uint64_t buf[3];
     pen_client_t *self = (pen_client_t*)eb;
-    pen_aes_data_t *data;
-    int idx;
+    pen_frame_t frame;
+    ssize_t ret;
 
     if (pe == PEN_EVENT_CLOSE)
         return _on_close(eb);
 
-    int ret = read(eb->fd_, buf, sizeof(buf));
-    if (ret == 0)
-        goto error;
-    if (ret != sizeof(uint64_t) * 2) {
-        PEN_WARN("unknown data received!");
-        goto error;
+    if ((pe & PEN_EVENT_WRITE) && self->out_len_ > 0) {
+        _flush_client(self);
+        if (eb->fd_ == -1)
+            return;
     }
 
-    data = (pen_aes_data_t*)buf;
-    pen_crypt_aes_decrypt(dekey, data);
-    if (data->u_[2] != 0x1c2b8695 || data->u_[3] >= MAX_CLIENT_NUMBER)
+    if ((pe & PEN_EVENT_READ) == 0)
+        return;
+
+    ret = pen_frame_recv(&self->frame_, eb->fd_);
+    if (ret == 0 || (ret < 0 && errno != EAGAIN))
         goto error;
-    idx = data->u_[3];
-    if (clients[idx] == NULL || self->ip_ != clients[idx]->ip_)
-        _on_client_ip_changed(self);
-    if (clients[idx] != NULL) {
-        if (clients[idx]->eb_.fd_ != -1)
-            close(clients[idx]->eb_.fd_);
-        pen_memory_pool_put(pool, clients[idx]);
-    }
-    clients[idx] = self;
-    return;
+    if (ret > 0)
+        pen_stats_add(counters, PEN_STAT_BYTES_IN, ret);
+
+    while ((ret = pen_frame_next(&self->frame_, key, &frame)) > 0) {
+        if (!_on_frame(self, &frame))
+            goto bad;
+        /* a full output queue drops the client */
+        if (eb->fd_ == -1)
+            return;
+    }
+    if (ret == 0)
+        return;
+bad:
+    PEN_WARN("bad frame from %s", pen_ntop(&self->ip_));
+    pen_stats_add(counters, PEN_STAT_BAD_FRAMES, 1);
 error:
     close(eb->fd_);
     _on_close(eb);
 }
 
+PEN_LOOP_TIMED(_on_event)
+
 static pen_event_base_t *
 on_new_client(pen_event_t ev,
               pen_socket_t fd,
               void *user PEN_UNUSED,
               struct sockaddr_in *addr)
 {
-    pen_client_t *client = pen_memory_pool_get(pool);
-    pen_assert2(client != NULL);
+    pen_client_t *client = _client_get();
     pen_event_base_t *eb = &client->eb_;
 
-    pen_assert2(pen_set_sockopt(fd, SO_RCVLOWAT, sizeof(uint64_t) * 2));
-    pen_assert2(pen_set_sockopt(fd, SO_RCVBUF, sizeof(uint64_t) * 3));
-    pen_assert2(pen_set_sockopt(fd, SO_SNDBUF, sizeof(uint64_t) * 3));
-
     eb->fd_ = fd;
-    eb->on_event_= _on_event;
+    eb->on_event_= _on_event_timed;
     client->ip_ = addr->sin_addr.s_addr;
+    pen_frame_init(&client->frame_);
+    pen_stats_add(counters, PEN_STAT_ACCEPTS, 1);
+    pen_stats_add(counters, PEN_STAT_ACTIVE, 1);
+    client->live_next_ = live_clients;
+    if (live_clients != NULL)
+        live_clients->live_prev_ = client;
+    live_clients = client;
 
     pen_assert2(pen_event_add_r(ev, eb));
+    _queue_frame(client, PEN_FRAME_HELLO, NULL, 0);
     return eb;
 }
 
+/* a peer that stays silent for `misses` intervals is gone, do not wait for tcp */
+static void
+_on_heartbeat(void *user PEN_UNUSED)
+{
+    uint64_t now = pen_histogram_now();
+    pen_client_t *self, *next;
+
+    for (self = live_clients; self != NULL; self = next) {
+        next = self->live_next_;
+        if (self->missed_++ >= misses) {
+            PEN_WARN("heartbeat lost: %s, srtt %u us", pen_ntop(&self->ip_), self->srtt_);
+            pen_stats_add(counters, PEN_STAT_HEARTBEAT_LOST, 1);
+            close(self->eb_.fd_);
+            _on_close(&self->eb_);
+        } else if (self->frame_.peer_ != 0) {
+            _queue_frame(self, PEN_FRAME_PING, &now, sizeof(now));
+        }
+    }
+}
+
 static void
 _on_signal(int sig PEN_UNUSED)
 {
@@ -163,22 +576,16 @@ _on_signal(int sig PEN_UNUSED)
     running = false;
 }
 
-static void
-start_server(pen_event_t ev)
+static bool
+_keep_running(void *user PEN_UNUSED)
 {
-    int ret = 0;
-
-    do {
-        fflush(NULL);
-        ret = pen_event_wait(ev, -1);
-    } while (running && ret >= 0);
+    return running;
 }
 
 int
 main(int argc, char *argv[])
 {
     pen_listener_t listener = NULL;
-    pen_event_t ev = NULL;
 
     _init_options(argc, argv);
 
@@ -186,13 +593,15 @@ main(int argc, char *argv[])
 
     pen_assert2(pen_log_init());
     pen_assert2(passwd != NULL);
-    enkey = pen_crypt_aes_encrypt_init((uint8_t*)passwd);
-    pen_assert2(enkey != NULL);
-    dekey = pen_crypt_aes_decrypt_init((uint8_t*)passwd);
-    pen_assert2(dekey != NULL);
-
-    pool = PEN_MEMORY_POOL_INIT(8, pen_client_t);
-    pen_assert2(pool != NULL);
+    key = pen_frame_key_init(passwd);
+    pen_assert2(key != NULL);
+
+    pen_assert2(chunk_size > 0);
+    _track_table_init(&tracks, 64);
+    if (state_file != NULL) {
+        state = pen_state_open(state_file);
+        pen_assert2(state != NULL);
+    }
 
     ev = pen_event_init(8);
     pen_assert2(ev != NULL);
@@ -204,14 +613,33 @@ main(int argc, char *argv[])
     listener = pen_listener_init(ev, NULL, port, 10, on_new_client, NULL);
     pen_assert2(listener != NULL);
 
-    start_server(ev);
+    stats = pen_stats_init("pen_keepalive", stat_descs, PEN_STAT_NUM, 1);
+    pen_assert2(stats != NULL);
+    counters = pen_stats_block(stats, 0);
+    pen_assert2(pen_stats_start(stats, ev, stats_port, stats_dump));
+    pen_assert2(pen_stats_watch(stats, 0, ev));
+
+    if (heartbeat > 0) {
+        heartbeat_timer = pen_timer_init(ev, _on_heartbeat, NULL);
+        pen_assert2(heartbeat_timer != NULL);
+        pen_timer_settime(heartbeat_timer, heartbeat);
+    }
+
+    pen_loop_run("keepalive_server", ev, -1, true, _keep_running, NULL);
 
+    if (heartbeat_timer != NULL)
+        pen_timer_destroy(heartbeat_timer);
+    pen_stats_destroy(stats);
     pen_listener_destroy(listener);
     pen_signal_destroy();
     pen_event_destroy(ev);
-    pen_memory_pool_destroy(pool);
-    pen_crypt_aes_destroy(enkey);
-    pen_crypt_aes_destroy(dekey);
+    free(tracks.slots_);
+    if (state != NULL)
+        pen_state_close(state);
+    for (uint32_t i = 0; i < chunk_num; i++)
+        free(chunks[i]);
+    free(chunks);
+    pen_frame_key_destroy(key);
     pen_log_destroy();
     return 0;
 }
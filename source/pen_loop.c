@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pen_histogram.h"
+#include "pen_loop.h"
+
+typedef struct {
+    pen_histogram_t events_;
+    pen_histogram_t callback_;
+    pen_histogram_t flush_;
+    uint64_t wakeups_;
+    uint64_t busy_;
+    uint64_t slowest_;
+    int slowest_fd_;
+} pen_loop_stats_t;
+
+uint16_t pen_loop_profiling = 0;
+static __thread pen_loop_stats_t *current = NULL;
+
+void
+pen_loop_timed(void (*fn)(pen_event_base_t *, uint16_t),
+               pen_event_base_t *eb, uint16_t pe)
+{
+    pen_loop_stats_t *stats = current;
+    int fd = eb->fd_;
+    uint64_t start, cost;
+
+    if (stats == NULL)
+        return fn(eb, pe);
+
+    start = pen_histogram_now();
+    fn(eb, pe);
+    cost = pen_histogram_now() - start;
+
+    pen_histogram_record(&stats->callback_, cost);
+    stats->busy_ += cost;
+    if (cost > stats->slowest_) {
+        stats->slowest_ = cost;
+        stats->slowest_fd_ = fd;
+    }
+}
+
+static void
+_report(const char *name, const pen_loop_stats_t *stats)
+{
+    const pen_histogram_t *ev = &stats->events_;
+    char title[128];
+
+    printf("loop %s: wakeups %llu, events per wakeup p50 %llu, p99 %llu, max %llu\n",
+           name, (unsigned long long)stats->wakeups_,
+           (unsigned long long)pen_histogram_percentile(ev, 50),
+           (unsigned long long)pen_histogram_percentile(ev, 99),
+           (unsigned long long)ev->max_);
+    snprintf(title, sizeof(title), "loop %s callbacks", name);
+    pen_histogram_print(&stats->callback_, title);
+    snprintf(title, sizeof(title), "loop %s fflush", name);
+    pen_histogram_print(&stats->flush_, title);
+    printf("loop %s: %.3fms in callbacks, slowest %.1fus on fd %d\n",
+           name, stats->busy_ / 1e6, stats->slowest_ / 1000.0, stats->slowest_fd_);
+}
+
+static void
+_run_profiled(const char *name, pen_event_t ev, int timeout, bool flush,
+              pen_loop_cond_t cond, void *user)
+{
+    pen_loop_stats_t *stats = calloc(1, sizeof(*stats));
+    uint64_t start;
+    int ret;
+
+    pen_assert2(stats != NULL);
+    stats->slowest_fd_ = -1;
+    current = stats;
+
+    do {
+        if (flush) {
+            start = pen_histogram_now();
+            fflush(NULL);
+            pen_histogram_record(&stats->flush_, pen_histogram_now() - start);
+        }
+        ret = pen_event_wait(ev, timeout);
+        stats->wakeups_++;
+        /* every ready fd, listeners, timers and signals included */
+        if (ret >= 0)
+            pen_histogram_record(&stats->events_, ret);
+    } while (ret >= 0 && cond(user));
+
+    current = NULL;
+    _report(name, stats);
+    free(stats);
+}
+
+void
+pen_loop_run(const char *name, pen_event_t ev, int timeout, bool flush,
+             pen_loop_cond_t cond, void *user)
+{
+    int ret;
+
+    if (pen_loop_profiling)
+        return _run_profiled(name, ev, timeout, flush, cond, user);
+
+    do {
+        if (flush)
+            fflush(NULL);
+        ret = pen_event_wait(ev, timeout);
+    } while (ret >= 0 && cond(user));
+}
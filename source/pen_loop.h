@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_LOOP_H
+#define PEN_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pen_socket/pen_event.h>
+
+/* set by --profile-loop, checked once per wakeup and once per timed callback */
+extern uint16_t pen_loop_profiling;
+
+typedef bool (*pen_loop_cond_t)(void *user);
+
+/*
+ * The loop every tool runs: fflush(NULL) if `flush`, wait on `ev`, and go on
+ * while the wait succeeds and `cond` agrees. When profiling, prints events
+ * per wakeup, callback and fflush timings and the slowest fd on return.
+ */
+void pen_loop_run(const char *name, pen_event_t ev, int timeout, bool flush,
+                  pen_loop_cond_t cond, void *user);
+
+void pen_loop_timed(void (*fn)(pen_event_base_t *, uint16_t),
+                    pen_event_base_t *eb, uint16_t pe);
+
+/* defines fn##_timed, an on_event_ callback that reports to the running loop */
+#define PEN_LOOP_TIMED(fn) \
+static void \
+fn##_timed(pen_event_base_t *eb, uint16_t pe) \
+{ \
+    if (__builtin_expect(pen_loop_profiling, 0)) \
+        return pen_loop_timed(fn, eb, pe); \
+    fn(eb, pe); \
+}
+
+#endif /* PEN_LOOP_H */
@@ -14,9 +14,21 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include <pen_utils/pen_options.h>
 #include <pen_socket/pen_event.h>
@@ -25,38 +37,187 @@
 #include <pen_socket/pen_timer.h>
 #include <pen_test/pen_speed.h>
 
+#include "pen_histogram.h"
+#include "pen_loop.h"
+#include "pen_runner.h"
+
+#define PING "ping"
+#define PING_SIZE sizeof(PING) - 1
 #define PONG "pong"
 #define PONG_SIZE sizeof(PONG) - 1
+#define PEN_READ_SIZE 4096
+
+#if defined(__linux__) && !defined(IP_BIND_ADDRESS_NO_PORT)
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
 
-static bool running = true;
+static atomic_bool running = true;
 static uint16_t port = 1234;
 static uint16_t conn_num = 128;
 static uint16_t group = 2;
+static uint16_t thread_num = 1;
+static uint16_t depth = 1;
 static uint32_t count = 5000;
+static uint32_t rate = 0;
+static uint64_t interval_ns = 0;
 static const char *host = "127.0.0.1";
+static uint16_t churn = 0;
+static uint16_t linger = 0;
+static uint16_t reuseaddr = 0;
+static uint16_t sources = 0;
+static const char *source = "127.0.0.1";
+static uint32_t source_base = 0;
+static struct sockaddr_in target;
+static uint16_t procs = 1;
+static const char *json = NULL;
+static atomic_uint_fast16_t active = 0;
+static atomic_uint_fast64_t connect_failed = 0;
+static char *pings = NULL;
+
+typedef struct pen_worker_s pen_worker_t;
 
 typedef struct {
     pen_event_base_t eb_;
-    pen_event_t ev_;
+    pen_worker_t *worker_;
     char buf_[PONG_SIZE];
     unsigned offset_;
     uint32_t count_;
-    pen_speed_t *speeder_;
+    uint32_t sent_num_;
+    uint32_t cycles_;
+    /* ping bytes a full socket did not take yet, all pings look the same */
+    size_t unsent_;
     bool connected_;
+    bool writing_;
+    uint64_t next_;
+    uint64_t start_;
+    uint64_t *sent_;
+    pen_histogram_t hist_;
 } pen_connector_t;
 
+struct pen_worker_s {
+    pen_event_t ev_;
+    pen_connector_t *conns_;
+    uint64_t *sent_;
+    pen_speed_t speeder_;
+    pen_event_base_t *ticker_;
+    pen_event_base_t *pacer_;
+    pthread_t thread_;
+    pthread_mutex_t lock_;
+    pen_histogram_t hist_;
+    /* churn only, connect_ belongs to the worker thread */
+    pen_histogram_t connect_;
+    pen_histogram_t connect_hist_;
+    atomic_uint_fast64_t done_;
+    uint64_t reported_;
+    uint32_t num_;
+    uint32_t source_;
+    uint16_t gp_;
+    uint16_t conn_num_;
+    uint16_t id_;
+    char name_[32];
+};
+
+static pen_worker_t *workers = NULL;
+static pen_speed_t speeder;
+static pen_histogram_t interval;
+static pen_histogram_t cumulative;
+static pen_histogram_t connect_interval;
+static pen_histogram_t connect_cumulative;
+
+typedef struct {
+    uint64_t done_;
+    uint64_t p50_;
+    uint64_t p99_;
+} pen_runner_interval_t;
+
+/* a worker process keeps what its full ring did not take yet in pending */
+static pen_runner_t runner = NULL;
+static int runner_id = -1;
+static pen_runner_sample_t pending;
+static uint64_t runner_done = 0;
+static uint64_t runner_failed = 0;
+static pen_runner_sample_t runner_interval;
+static pen_runner_sample_t runner_total;
+static pen_runner_interval_t *intervals = NULL;
+static uint32_t interval_num = 0;
+
 static void _on_event(pen_event_base_t *, uint16_t);
+PEN_LOOP_TIMED(_on_event)
 
+/*
+ * churn opens its own sockets, they need options before connect and
+ * a name lookup per connection would be measured as well.
+ */
 static void
-create_connector(pen_event_t ev, pen_connector_t *self, pen_speed_t *speeder)
+_churn_connect(pen_connector_t *self)
 {
+    pen_worker_t *worker = self->worker_;
+    struct sockaddr_in src;
+    struct linger lg = {1, 0};
+    int fd, on = 1;
+
+    self->eb_.fd_ = PEN_INVALID_SOCK;
+    self->offset_ = 0;
+    self->count_ = 0;
+    self->sent_num_ = 0;
+    self->unsent_ = 0;
+    self->connected_ = false;
+    self->writing_ = false;
+    self->start_ = pen_histogram_now();
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        goto failed;
+
+    if (linger)
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    if (reuseaddr)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (sources > 0) {
+        /* every source address gets the whole local port range */
+#ifdef __linux__
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(source_base + worker->source_++ % sources);
+        if (bind(fd, (struct sockaddr *)&src, sizeof(src)) != 0)
+            goto failed;
+    }
+
+    if (connect(fd, (struct sockaddr *)&target, sizeof(target)) != 0 && errno != EINPROGRESS)
+        goto failed;
+
+    self->eb_.fd_ = fd;
+    pen_assert2(pen_event_add_rw(worker->ev_, (pen_event_base_t*)self));
+    return;
+
+failed:
+    /* mostly EADDRNOTAVAIL once TIME_WAIT ate the ports, retried by the ticker */
+    atomic_fetch_add_explicit(&connect_failed, 1, memory_order_relaxed);
+    if (fd >= 0)
+        close(fd);
+}
+
+static void
+create_connector(pen_worker_t *worker, pen_connector_t *self)
+{
+    if (churn) {
+        self->worker_ = worker;
+        self->sent_ = worker->sent_ + (self - worker->conns_) * depth;
+        self->eb_.on_event_ = _on_event_timed;
+        return _churn_connect(self);
+    }
+
     pen_assert2(pen_connect_tcp(&self->eb_, host, port));
 
-    self->ev_ = ev;
-    self->eb_.on_event_ = _on_event;
-    self->speeder_ = speeder;
+    self->worker_ = worker;
+    self->sent_ = worker->sent_ + (self - worker->conns_) * depth;
+    self->eb_.on_event_ = _on_event_timed;
+    /* spread the first request of each connector over one interval */
+    self->next_ = pen_histogram_now() +
+        interval_ns * (self - worker->conns_) / worker->conn_num_;
 
-    pen_assert2(pen_event_add_rw(ev, (pen_event_base_t*)self));
+    pen_assert2(pen_event_add_rw(worker->ev_, (pen_event_base_t*)self));
 }
 
 static inline void
@@ -70,8 +231,19 @@ _init_options(int argc, char *argv[])
         _i(--port, port, "port(default 1234)")
         _i(--conn, conn_num, "connector number(default 128)")
         _i(--group, group, "number of connector groups(default 2)")
+        _i(--threads, thread_num, "number of client threads(default 1)")
+        _i(--depth, depth, "requests in flight per connector(default 1)")
         _li(--repeat, count, "request number(default 5000)")
+        _li(--rate, rate, "open-loop requests per second, 0 is closed-loop(default 0)")
         _s(--host, host, "remote host(default 127.0.0.1)")
+        _i(--churn, churn, "one ping per connection, --repeat connections per connector(default 0)")
+        _i(--linger, linger, "churn closes with RST through SO_LINGER 0(default 0)")
+        _i(--reuseaddr, reuseaddr, "churn sets SO_REUSEADDR(default 0)")
+        _i(--sources, sources, "churn binds to --source and the next N-1 addresses(default 0)")
+        _s(--source, source, "first source address of --sources(default 127.0.0.1)")
+        _i(--procs, procs, "worker processes, each running the whole test(default 1)")
+        _s(--json, json, "merged summary of --procs > 1 as json, stdout moves the report to stderr(default stdout)")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
     };
 
     PEN_OPTIONS_INIT(argc, argv, opts);
@@ -87,58 +259,171 @@ _on_signal(int sig PEN_UNUSED)
     running = false;
 }
 
+static bool
+_keep_running(void *user PEN_UNUSED)
+{
+    return running && active > 0;
+}
+
+static inline void
+_collect_connector(pen_worker_t *worker, pen_connector_t *self)
+{
+    pthread_mutex_lock(&worker->lock_);
+    pen_histogram_merge(&worker->hist_, &self->hist_);
+    pthread_mutex_unlock(&worker->lock_);
+    pen_histogram_reset(&self->hist_);
+}
+
 static void
-start_server(pen_event_t ev)
+_retire(pen_connector_t *self)
 {
-    int ret = 0;
+    pen_worker_t *worker = self->worker_;
 
-    do {
-        fflush(NULL);
-        ret = pen_event_wait(ev, -1);
-    } while (running && ret >= 0);
+    _collect_connector(worker, self);
+    if (++worker->num_ == worker->conn_num_) {
+        if (++worker->gp_ >= group) {
+            active--;
+            return;
+        }
+        worker->num_ = 0;
+    }
+
+    memset(self, 0, sizeof(*self));
+    create_connector(worker, self);
 }
 
 static void
 _on_close(pen_event_base_t *eb)
 {
     pen_connector_t *self = (pen_connector_t*)eb;
-    static uint32_t num = 0;
-    static uint16_t gp = 0;
-    pen_speed_t *speeder = self->speeder_;
-    pen_event_t ev = self->ev_;
 
     pen_assert2(self->count_ == count);
     close(eb->fd_);
-    if (++num == conn_num) {
-        if (++gp >= group) {
-            running = false;
-            return;
+    _retire(self);
+}
+
+/* churn: the pong arrived or the connection failed, go on with a new one */
+static void
+_on_churned(pen_connector_t *self, bool ok)
+{
+    close(self->eb_.fd_);
+    self->eb_.fd_ = PEN_INVALID_SOCK;
+    if (!ok) {
+        atomic_fetch_add_explicit(&connect_failed, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (++self->cycles_ == count)
+        return _retire(self);
+    _churn_connect(self);
+}
+
+static void
+_flush_pings(pen_connector_t *self)
+{
+    size_t size = (size_t)depth * PING_SIZE;
+    size_t off, len;
+    ssize_t ret;
+
+    while (self->unsent_ > 0) {
+        off = (PING_SIZE - self->unsent_ % PING_SIZE) % PING_SIZE;
+        len = self->unsent_ < size - off ? self->unsent_ : size - off;
+        ret = send(self->eb_.fd_, pings + off, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0) {
+            /* a broken connection shows up on the read side */
+            if (errno != EAGAIN)
+                PEN_WARN("write error: %s", strerror(errno));
+            break;
         }
-        num = 0;
+        self->unsent_ -= ret;
     }
 
-    memset(self, 0, sizeof(*self));
-    create_connector(ev, self, speeder);
+    if (self->unsent_ > 0 && !self->writing_)
+        pen_assert2(pen_event_mod_rw(self->worker_->ev_, &self->eb_));
+    else if (self->unsent_ == 0 && self->writing_)
+        pen_assert2(pen_event_mod_r(self->worker_->ev_, &self->eb_));
+    self->writing_ = self->unsent_ > 0;
+}
+
+static inline void
+_write_pings(pen_connector_t *self, uint32_t num)
+{
+    self->unsent_ += num * PING_SIZE;
+    _flush_pings(self);
+}
+
+static void
+_send_pings(pen_connector_t *self, uint32_t num)
+{
+    uint64_t now = pen_histogram_now();
+
+    if (num > count - self->sent_num_)
+        num = count - self->sent_num_;
+    if (num == 0)
+        return;
+
+    for (uint32_t i = 0; i < num; i++)
+        self->sent_[(self->sent_num_ + i) % depth] = now;
+    self->sent_num_ += num;
+
+    _write_pings(self, num);
+}
+
+/*
+ * open-loop: send every request whose slot on the timeline has passed,
+ * stamped with its intended time so a stalled server shows up as latency.
+ */
+static void
+_send_scheduled(pen_connector_t *self, uint64_t now)
+{
+    uint32_t num = 0;
+
+    while (self->next_ <= now && self->sent_num_ < count &&
+           self->sent_num_ - self->count_ < depth) {
+        self->sent_[self->sent_num_++ % depth] = self->next_;
+        self->next_ += interval_ns;
+        num++;
+    }
+    if (num > 0)
+        _write_pings(self, num);
 }
 
 static bool
 _on_write(pen_event_base_t *eb)
 {
     pen_connector_t *self = (pen_connector_t *)eb;
-    if (self->connected_)
+    if (self->connected_) {
+        _flush_pings(self);
         return true;
+    }
     self->connected_ = true;
-    pen_assert2(write(eb->fd_, "ping", 4) == 4);
-    pen_assert2(pen_event_mod_r(self->ev_, eb));
+    if (churn)
+        pen_histogram_record(&self->worker_->connect_, pen_histogram_now() - self->start_);
+    /* watch reads only, unless the first pings did not fit */
+    self->writing_ = true;
+    if (rate > 0)
+        _send_scheduled(self, pen_histogram_now());
+    else
+        _send_pings(self, depth);
+    if (self->writing_ && self->unsent_ == 0) {
+        pen_assert2(pen_event_mod_r(self->worker_->ev_, eb));
+        self->writing_ = false;
+    }
     return true;
 }
 
 static void
 _on_event(pen_event_base_t *eb, uint16_t pe)
 {
+    char buf[PEN_READ_SIZE];
+    unsigned size, pos;
+    uint32_t num = 0;
+    uint64_t now;
     int ret;
     pen_connector_t *self = (pen_connector_t *)eb;
 
+    if (pe == PEN_EVENT_CLOSE && churn)
+        return _on_churned(self, false);
     if (pe == PEN_EVENT_CLOSE)
         return _on_close(eb);
 
@@ -148,45 +433,454 @@ _on_event(pen_event_base_t *eb, uint16_t pe)
     if ((pe & PEN_EVENT_READ) == 0)
         return;
 
-    ret = read(eb->fd_, self->buf_ + self->offset_, PONG_SIZE - self->offset_);
+    memcpy(buf, self->buf_, self->offset_);
+    ret = read(eb->fd_, buf + self->offset_, sizeof(buf) - self->offset_);
+    if (ret <= 0 && churn)
+        return _on_churned(self, false);
     if (ret <= 0) {
         PEN_WARN("read error!!!");
         _on_close(eb);
         return;
     }
 
-    self->offset_ += ret;
-    if (self->offset_ < PONG_SIZE)
+    size = self->offset_ + ret;
+    now = pen_histogram_now();
+    for (pos = 0; pos + PONG_SIZE <= size; pos += PONG_SIZE, num++) {
+        pen_assert2(strncmp(PONG, buf + pos, PONG_SIZE) == 0);
+        pen_histogram_record(&self->hist_,
+                now - self->sent_[(self->count_ + num) % depth]);
+    }
+    self->offset_ = size - pos;
+    memcpy(self->buf_, buf + pos, self->offset_);
+    if (num == 0)
         return;
 
-    self->offset_ = 0;
-    pen_assert2(strncmp(PONG, self->buf_, PONG_SIZE) == 0);
-
-    pen_speed_add(self->speeder_, 1);
+    pen_assert2(self->count_ + num <= self->sent_num_);
+    pen_speed_add(&self->worker_->speeder_, num);
+    atomic_fetch_add_explicit(&self->worker_->done_, num, memory_order_relaxed);
 
-    self->count_ ++;
+    self->count_ += num;
+    if (churn)
+        return _on_churned(self, true);
     if (self->count_ == count)
-        _on_close(eb);
+        return _on_close(eb);
+
+    if (rate > 0)
+        _send_scheduled(self, now);
     else
-        pen_assert2(write(eb->fd_, "ping", 4) == 4);
+        _send_pings(self, num);
+}
+
+static void
+_merge_workers(void)
+{
+    uint64_t done;
+
+    for (uint16_t i = 0; i < thread_num; i++) {
+        done = atomic_load_explicit(&workers[i].done_, memory_order_relaxed);
+        pen_speed_add(&speeder, done - workers[i].reported_);
+        workers[i].reported_ = done;
+    }
+}
+
+static bool _keep_working(void *user);
+
+static void
+_on_worker_timer(void *arg)
+{
+    pen_worker_t *worker = arg;
+    pen_connector_t *self;
+
+    for (uint16_t i = 0; i < worker->conn_num_; i++) {
+        self = &worker->conns_[i];
+        _collect_connector(worker, self);
+        /* connectors whose connect failed wait here for the next try */
+        if (churn && self->eb_.fd_ == PEN_INVALID_SOCK && self->cycles_ < count &&
+            _keep_working(worker))
+            _churn_connect(self);
+    }
+
+    if (!churn)
+        return;
+    pthread_mutex_lock(&worker->lock_);
+    pen_histogram_merge(&worker->connect_hist_, &worker->connect_);
+    pthread_mutex_unlock(&worker->lock_);
+    pen_histogram_reset(&worker->connect_);
+}
+
+static void
+_on_pacer_timer(void *arg)
+{
+    pen_worker_t *worker = arg;
+    uint64_t now = pen_histogram_now();
+
+    for (uint16_t i = 0; i < worker->conn_num_; i++) {
+        if (worker->conns_[i].connected_)
+            _send_scheduled(&worker->conns_[i], now);
+    }
+}
+
+/* TIME_WAIT sockets pin local ports, they are what runs out first under churn */
+static void
+_report_churn(void)
+{
+    unsigned long long failed = atomic_load_explicit(&connect_failed, memory_order_relaxed);
+    unsigned inuse, orphan, tw = 0;
+    char line[256];
+    FILE *fp;
+
+    fp = fopen("/proc/net/sockstat", "r");
+    if (fp != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "TCP: inuse %u orphan %u tw %u", &inuse, &orphan, &tw) == 3)
+                break;
+        }
+        fclose(fp);
+    }
+    printf("churn: failed connections %llu, TIME_WAIT sockets %u\n", failed, tw);
+}
+
+static void
+_runner_push(bool final)
+{
+    uint64_t done = 0, failed;
+
+    for (uint16_t i = 0; i < thread_num; i++)
+        done += atomic_load_explicit(&workers[i].done_, memory_order_relaxed);
+    failed = atomic_load_explicit(&connect_failed, memory_order_relaxed);
+    pending.done_ += done - runner_done;
+    pending.failed_ += failed - runner_failed;
+    runner_done = done;
+    runner_failed = failed;
+    pen_histogram_merge(&pending.latency_, &interval);
+    pen_histogram_merge(&pending.connect_, &connect_interval);
+
+    /* the runner drains every second, only the last sample is worth waiting for */
+    while (!pen_runner_push(runner, runner_id, &pending)) {
+        if (!final)
+            return;
+        usleep(10000);
+    }
+    pen_runner_reset(&pending);
+}
+
+static void
+_report_latency(bool final)
+{
+    for (uint16_t i = 0; i < thread_num; i++) {
+        pthread_mutex_lock(&workers[i].lock_);
+        pen_histogram_merge(&interval, &workers[i].hist_);
+        pen_histogram_reset(&workers[i].hist_);
+        pen_histogram_merge(&connect_interval, &workers[i].connect_hist_);
+        pen_histogram_reset(&workers[i].connect_hist_);
+        pthread_mutex_unlock(&workers[i].lock_);
+    }
+    pen_histogram_merge(&cumulative, &interval);
+    pen_histogram_merge(&connect_cumulative, &connect_interval);
+    if (runner != NULL)
+        _runner_push(final);
+
+    if (!final)
+        pen_histogram_print(&interval, "latency interval");
+    pen_histogram_print(&cumulative, "latency total");
+    pen_histogram_reset(&interval);
+    if (!churn)
+        return;
+
+    /* the ping of a fresh connection waits for the server to accept it */
+    if (!final)
+        pen_histogram_print(&connect_interval, "connect interval");
+    pen_histogram_print(&connect_cumulative, "connect total");
+    pen_histogram_reset(&connect_interval);
+    _report_churn();
+}
+
+static void
+_on_timer(void *arg PEN_UNUSED)
+{
+    if (thread_num == 1) {
+        pen_speed_current(&workers[0].speeder_);
+    } else {
+        _merge_workers();
+        pen_speed_current(&speeder);
+    }
+    _report_latency(false);
+}
+
+static void
+_init_worker(pen_worker_t *worker, uint16_t id, pen_event_t ev)
+{
+    worker->id_ = id;
+    worker->ev_ = ev;
+    worker->conn_num_ = conn_num / thread_num + (id < conn_num % thread_num);
+    worker->conns_ = calloc(worker->conn_num_, sizeof(pen_connector_t));
+    pen_assert2(worker->conns_ != NULL);
+    worker->sent_ = calloc((size_t)worker->conn_num_ * depth, sizeof(uint64_t));
+    pen_assert2(worker->sent_ != NULL);
+    snprintf(worker->name_, sizeof(worker->name_), "client test #%u", id);
+    pen_assert2(pthread_mutex_init(&worker->lock_, NULL) == 0);
+    worker->ticker_ = pen_timer_init(ev, _on_worker_timer, worker);
+    pen_assert2(worker->ticker_ != NULL);
+    pen_timer_settime(worker->ticker_, 1000);
+    if (rate > 0) {
+        worker->pacer_ = pen_timer_init(ev, _on_pacer_timer, worker);
+        pen_assert2(worker->pacer_ != NULL);
+        pen_timer_settime(worker->pacer_, 1);
+    }
+
+    for (uint16_t i = 0; i < worker->conn_num_; i++)
+        create_connector(worker, &worker->conns_[i]);
+}
+
+static void
+_pin_worker(pen_worker_t *worker)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu <= 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(worker->id_ % ncpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        PEN_WARN("unable to pin %s to cpu %ld", worker->name_, worker->id_ % ncpu);
+#else
+    (void)worker;
+#endif
+}
+
+static bool
+_keep_working(void *user)
+{
+    pen_worker_t *worker = user;
+
+    return running && worker->gp_ < group;
+}
+
+static void *
+_worker_main(void *arg)
+{
+    pen_worker_t *worker = arg;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    _pin_worker(worker);
+    pen_speed_init(&worker->speeder_, worker->name_);
+
+    pen_loop_run(worker->name_, worker->ev_, 100, false, _keep_working, worker);
+
+    _on_worker_timer(worker);
+
+    pen_speed_end(&worker->speeder_);
+    return NULL;
+}
+
+static void
+_init_target(void)
+{
+    struct addrinfo hints, *res;
+    struct in_addr addr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    pen_assert2(getaddrinfo(host, NULL, &hints, &res) == 0);
+    memcpy(&target, res->ai_addr, sizeof(target));
+    target.sin_port = htons(port);
+    freeaddrinfo(res);
+
+    if (sources == 0)
+        return;
+    pen_assert2(inet_pton(AF_INET, source, &addr) == 1);
+    source_base = ntohl(addr.s_addr);
+    /* loopback sources can only reach loopback targets */
+    if ((source_base >> 24) == 127 && (ntohl(target.sin_addr.s_addr) >> 24) != 127) {
+        PEN_ERROR("--sources binds to %s, give a --source that can reach %s", source, host);
+        exit(1);
+    }
 }
 
 static void
-_on_timer(void *arg)
+_json_histogram(FILE *fp, const char *name, const pen_histogram_t *hist)
 {
-    pen_speed_t *speeder = arg;
-    pen_speed_current(speeder);
+#define _us(p) pen_histogram_percentile(hist, p) / 1000.0
+
+    fprintf(fp, "\"%s\":{\"count\":%llu,\"p50\":%.1f,\"p90\":%.1f,"
+            "\"p99\":%.1f,\"p99.9\":%.1f,\"max\":%.1f}", name,
+            (unsigned long long)hist->count_, _us(50), _us(90), _us(99), _us(99.9),
+            hist->max_ / 1000.0);
+#undef _us
+}
+
+static void
+_runner_json(FILE *fp, uint64_t elapsed)
+{
+    fprintf(fp, "{\"procs\":%u,\"conns\":%u,\"threads\":%u,\"churn\":%s,"
+            "\"seconds\":%.3f,\"done\":%llu,\"failed\":%llu,\"rate\":%.1f,",
+            procs, conn_num, thread_num, churn ? "true" : "false", elapsed / 1e9,
+            (unsigned long long)runner_total.done_,
+            (unsigned long long)runner_total.failed_,
+            elapsed > 0 ? runner_total.done_ * 1e9 / elapsed : 0.0);
+    _json_histogram(fp, "latency_us", &runner_total.latency_);
+    if (churn) {
+        fputc(',', fp);
+        _json_histogram(fp, "connect_us", &runner_total.connect_);
+    }
+    fputs(",\"intervals\":[", fp);
+    for (uint32_t i = 0; i < interval_num; i++) {
+        fprintf(fp, "%s{\"done\":%llu,\"p50\":%.1f,\"p99\":%.1f}", i > 0 ? "," : "",
+                (unsigned long long)intervals[i].done_,
+                intervals[i].p50_ / 1000.0, intervals[i].p99_ / 1000.0);
+    }
+    fputs("]}\n", fp);
+    fclose(fp);
+}
+
+static void
+_on_runner_timer(void *arg PEN_UNUSED)
+{
+    pen_runner_interval_t *item;
+
+    pen_runner_drain(runner, &runner_interval);
+    pen_runner_merge(&runner_total, &runner_interval);
+
+    item = realloc(intervals, (interval_num + 1) * sizeof(*intervals));
+    pen_assert2(item != NULL);
+    intervals = item;
+    item = &intervals[interval_num++];
+    item->done_ = runner_interval.done_;
+    item->p50_ = pen_histogram_percentile(&runner_interval.latency_, 50);
+    item->p99_ = pen_histogram_percentile(&runner_interval.latency_, 99);
+
+    printf("%us: %llu done, %llu failed\n", interval_num,
+           (unsigned long long)runner_interval.done_,
+           (unsigned long long)runner_interval.failed_);
+    pen_histogram_print(&runner_interval.latency_, "latency interval");
+    if (churn)
+        pen_histogram_print(&runner_interval.connect_, "connect interval");
+    pen_runner_reset(&runner_interval);
+}
+
+static bool
+_runner_running(void *user PEN_UNUSED)
+{
+    return running && pen_runner_reap(runner) > 0;
+}
+
+/* the runner only collects, the workers are forked copies of this process */
+static int
+_run_runner(void)
+{
+    pen_event_t ev;
+    pen_event_base_t *timer;
+    uint64_t start, elapsed;
+    FILE *json_fp = NULL;
+    int fd;
+
+    /* stdout carries nothing but the json, the report goes to stderr */
+    if (json != NULL) {
+        json_fp = fopen(json, "w");
+        pen_assert2(json_fp != NULL);
+    } else {
+        fflush(stdout);
+        fd = dup(STDOUT_FILENO);
+        pen_assert2(fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0);
+        json_fp = fdopen(fd, "w");
+        pen_assert2(json_fp != NULL);
+    }
+
+    ev = pen_event_init(16);
+    pen_assert2(ev != NULL);
+
+    pen_assert2(pen_signal_init(ev));
+    pen_assert2(pen_signal(SIGTERM, _on_signal));
+    pen_assert2(pen_signal(SIGINT, _on_signal));
+
+    timer = pen_timer_init(ev, _on_runner_timer, NULL);
+    pen_assert2(timer != NULL);
+
+    if (!pen_runner_start(runner)) {
+        fclose(json_fp);
+        pen_runner_destroy(runner);
+        pen_timer_destroy(timer);
+        pen_signal_destroy();
+        pen_event_destroy(ev);
+        return 1;
+    }
+    start = pen_histogram_now();
+    pen_timer_settime(timer, 1000);
+
+    pen_loop_run("runner", ev, 100, true, _runner_running, NULL);
+
+    /* stopped workers still push their last sample, keep their rings moving */
+    if (!running)
+        pen_runner_kill(runner, SIGTERM);
+    while (pen_runner_reap(runner) > 0) {
+        pen_runner_drain(runner, &runner_interval);
+        usleep(10000);
+    }
+    elapsed = pen_histogram_now() - start;
+    _on_runner_timer(NULL);
+
+    printf("runner: %u procs, %llu done in %.2fs, %.1f/s, %llu failed\n", procs,
+           (unsigned long long)runner_total.done_, elapsed / 1e9,
+           runner_total.done_ * 1e9 / elapsed, (unsigned long long)runner_total.failed_);
+    pen_histogram_print(&runner_total.latency_, "latency total");
+    if (churn)
+        pen_histogram_print(&runner_total.connect_, "connect total");
+    _runner_json(json_fp, elapsed);
+
+    free(intervals);
+    pen_runner_destroy(runner);
+    pen_timer_destroy(timer);
+    pen_signal_destroy();
+    pen_event_destroy(ev);
+
+    puts("exit.");
+    return 0;
 }
 
 int
 main(int argc, char *argv[])
 {
     pen_event_t ev;
-    pen_connector_t *conns;
     pen_event_base_t *timer;
-    pen_speed_t speeder;
 
     _init_options(argc, argv);
+    pen_assert2(thread_num > 0 && thread_num <= conn_num);
+    pen_assert2(depth > 0);
+    pen_assert2(!churn || (depth == 1 && rate == 0));
+    if (json != NULL && procs < 2) {
+        PEN_ERROR("--json is the merged summary of --procs, it needs --procs 2 or more");
+        return 1;
+    }
+    if (churn)
+        _init_target();
+    if (rate > 0)
+        interval_ns = 1000000000ull * conn_num / rate;
+
+    pings = malloc((size_t)depth * PING_SIZE);
+    pen_assert2(pings != NULL);
+    for (uint16_t i = 0; i < depth; i++)
+        memcpy(pings + i * PING_SIZE, PING, PING_SIZE);
+
+    if (procs > 1) {
+        runner = pen_runner_init(procs);
+        pen_assert2(runner != NULL);
+        runner_id = pen_runner_fork(runner);
+        pen_assert2(runner_id >= 0);
+        if (runner_id == procs) {
+            free(pings);
+            return _run_runner();
+        }
+        /* warnings still reach stderr, the runner prints the merged report */
+        pen_assert2(freopen("/dev/null", "w", stdout) != NULL);
+    }
 
     ev = pen_event_init(16);
     pen_assert2(ev != NULL);
@@ -195,26 +889,63 @@ main(int argc, char *argv[])
     pen_assert2(pen_signal(SIGTERM, _on_signal));
     pen_assert2(pen_signal(SIGINT, _on_signal));
 
-    timer = pen_timer_init(ev, _on_timer, &speeder);
+    timer = pen_timer_init(ev, _on_timer, NULL);
     pen_assert2(timer != NULL);
 
-    conns = calloc(conn_num, sizeof(pen_connector_t));
-    pen_assert2(conns != NULL);
-    for (uint16_t i = 0; i < conn_num; i++)
-        create_connector(ev, &conns[i], &speeder);
+    workers = calloc(thread_num, sizeof(pen_worker_t));
+    pen_assert2(workers != NULL);
+    active = thread_num;
+    /* the runner reports who failed, nothing to add here */
+    if (runner != NULL && !pen_runner_start(runner))
+        return 1;
+
+    if (thread_num == 1) {
+        _init_worker(&workers[0], 0, ev);
+        pen_speed_init(&workers[0].speeder_, "client test");
+        pen_timer_settime(timer, runner != NULL ? 1000 : 10000);
 
-    pen_speed_init(&speeder, "client test");
-    pen_timer_settime(timer, 10000);
+        pen_loop_run("ping", ev, -1, true, _keep_running, NULL);
 
-    start_server(ev);
+        _on_worker_timer(&workers[0]);
 
-    pen_speed_end(&speeder);
+        pen_speed_end(&workers[0].speeder_);
+    } else {
+        for (uint16_t i = 0; i < thread_num; i++) {
+            pen_event_t wev = pen_event_init(16);
+            pen_assert2(wev != NULL);
+            _init_worker(&workers[i], i, wev);
+        }
+        pen_speed_init(&speeder, "client test");
+        for (uint16_t i = 0; i < thread_num; i++)
+            pen_assert2(pthread_create(&workers[i].thread_, NULL,
+                        _worker_main, &workers[i]) == 0);
+        pen_timer_settime(timer, runner != NULL ? 1000 : 10000);
+
+        pen_loop_run("ping", ev, 100, true, _keep_running, NULL);
+
+        for (uint16_t i = 0; i < thread_num; i++)
+            pthread_join(workers[i].thread_, NULL);
+        _merge_workers();
+        pen_speed_end(&speeder);
+    }
+    _report_latency(true);
+
+    for (uint16_t i = 0; i < thread_num; i++) {
+        pen_timer_destroy(workers[i].ticker_);
+        if (workers[i].pacer_ != NULL)
+            pen_timer_destroy(workers[i].pacer_);
+        if (workers[i].ev_ != ev)
+            pen_event_destroy(workers[i].ev_);
+        pthread_mutex_destroy(&workers[i].lock_);
+        free(workers[i].conns_);
+        free(workers[i].sent_);
+    }
+    free(workers);
+    free(pings);
     pen_timer_destroy(timer);
     pen_signal_destroy();
     pen_event_destroy(ev);
-    free(conns);
 
     puts("exit.");
     return 0;
 }
-
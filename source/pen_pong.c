@@ -14,27 +14,79 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include <pen_utils/pen_options.h>
 #include <pen_utils/pen_memory_pool.h>
 #include <pen_socket/pen_event.h>
 #include <pen_socket/pen_signal.h>
+#include <pen_socket/pen_socket.h>
 #include <pen_socket/pen_listener.h>
 
+#include "pen_loop.h"
+#include "pen_stats.h"
+
 #define PING "ping"
 #define PING_SIZE sizeof(PING) - 1
+#define PONG "pong"
+#define PONG_SIZE sizeof(PONG) - 1
+#define PEN_BUF_SIZE 16384
+#define PEN_MAX_READS 4
 
-static bool running = true;
+static atomic_bool running = true;
 static uint16_t port = 1234;
 static uint16_t pool_size = 8;
-static pen_memory_pool_t pool;
+static uint16_t worker_num = 1;
+static uint16_t stats_port = 0;
+static uint16_t stats_dump = 0;
+static char pongs[PEN_BUF_SIZE];
+
+enum {
+    PEN_STAT_ACTIVE,
+    PEN_STAT_ACCEPTS,
+    PEN_STAT_PINGS,
+    PEN_STAT_BYTES_IN,
+    PEN_STAT_BYTES_OUT,
+    PEN_STAT_NUM,
+};
+
+static const pen_stats_desc_t stat_descs[PEN_STAT_NUM] = {
+    {"connections", "open client connections", true},
+    {"accepts_total", "accepted connections", false},
+    {"pings_total", "pings answered", false},
+    {"bytes_in_total", "bytes received", false},
+    {"bytes_out_total", "bytes sent", false},
+};
+
+typedef struct {
+    pen_event_t ev_;
+    pen_memory_pool_t pool_;
+    pen_listener_t listener_;
+    pen_event_base_t acceptor_;
+    pen_stats_block_t *stats_;
+    pthread_t thread_;
+    uint16_t id_;
+} pen_worker_t;
 
 typedef struct {
     pen_event_base_t eb_;
+    pen_event_t ev_;
+    pen_memory_pool_t pool_;
+    pen_stats_block_t *stats_;
     char buf_[PING_SIZE];
     unsigned offset_;
+    /* pong bytes owed to the client, all pongs look the same */
+    size_t pending_;
+    bool writing_;
 } pen_client_t;
 
 static inline void
@@ -45,6 +97,10 @@ _init_options(int argc, char *argv[])
     pen_option_t opts[] = {
         _i(--port, port, "port(default 1234)")
         _i(--pool, pool_size, "port size(default 8)")
+        _i(--workers, worker_num, "worker threads with SO_REUSEPORT listeners(default 1)")
+        _i(--stats, stats_port, "port of the stats listener, 0 to disable(default 0)")
+        _i(--dump, stats_dump, "seconds between stats dumps, 0 to disable(default 0)")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
     };
 
     PEN_OPTIONS_INIT(argc, argv, opts);
@@ -61,73 +117,255 @@ _on_signal(int sig PEN_UNUSED)
 static void
 _on_close(pen_event_base_t *eb)
 {
+    pen_client_t *self = (pen_client_t *)eb;
+
+    pen_stats_sub(self->stats_, PEN_STAT_ACTIVE, 1);
     close(eb->fd_);
-    pen_memory_pool_put(pool, eb);
+    pen_memory_pool_put(self->pool_, eb);
+}
+
+/* one writev() of the shared pong buffer, a full socket keeps the rest owed */
+static int
+_flush_pongs(pen_client_t *self)
+{
+    struct iovec iov[PEN_MAX_READS + 1];
+    size_t off = (PONG_SIZE - self->pending_ % PONG_SIZE) % PONG_SIZE;
+    size_t left = self->pending_;
+    int n = 0;
+    ssize_t ret;
+
+    for (; n < PEN_MAX_READS + 1 && left > 0; n++, off = 0) {
+        iov[n].iov_base = pongs + off;
+        iov[n].iov_len = left < sizeof(pongs) - off ? left : sizeof(pongs) - off;
+        left -= iov[n].iov_len;
+    }
+
+    ret = writev(self->eb_.fd_, iov, n);
+    if (ret < 0 && errno != EAGAIN)
+        return -1;
+    if (ret > 0) {
+        self->pending_ -= ret;
+        pen_stats_add(self->stats_, PEN_STAT_BYTES_OUT, ret);
+    }
+
+    if (self->pending_ > 0 && !self->writing_)
+        pen_assert2(pen_event_mod_rw(self->ev_, &self->eb_));
+    else if (self->pending_ == 0 && self->writing_)
+        pen_assert2(pen_event_mod_r(self->ev_, &self->eb_));
+    self->writing_ = self->pending_ > 0;
+    return 0;
 }
 
+/*
+ * drain up to PEN_MAX_READS buffers per wakeup, then answer every complete
+ * ping with a single writev() of the shared pong buffer.
+ */
 static void
 _on_event(pen_event_base_t *eb, uint16_t ev)
 {
-    int ret;
+    char buf[PEN_BUF_SIZE];
+    unsigned size, pos, offset;
+    size_t total = 0;
+    ssize_t ret;
     pen_client_t *self = (pen_client_t *)eb;
 
     if (ev == PEN_EVENT_CLOSE)
         return _on_close(eb);
 
-    ret = read(eb->fd_, self->buf_ + self->offset_, PING_SIZE - self->offset_);
-
-    if (ret <= 0)
-        return _on_close(eb);
-
-    self->offset_ += ret;
-    if (self->offset_ < PING_SIZE)
+    if ((ev & PEN_EVENT_READ) == 0) {
+        if (_flush_pongs(self) < 0)
+            _on_close(eb);
         return;
-
-    self->offset_ = 0;
-    pen_assert2(strncmp(PING, self->buf_, PING_SIZE) == 0);
-
-    pen_assert2(write(eb->fd_, "pong", 4) == 4);
+    }
+
+    for (int i = 0; i < PEN_MAX_READS; i++) {
+        offset = self->offset_;
+        memcpy(buf, self->buf_, offset);
+        if (i == 0)
+            ret = read(eb->fd_, buf + offset, sizeof(buf) - offset);
+        else
+            ret = recv(eb->fd_, buf + offset, sizeof(buf) - offset, MSG_DONTWAIT);
+
+        if (ret <= 0) {
+            if (i == 0)
+                return _on_close(eb);
+            break;
+        }
+
+        pen_stats_add(self->stats_, PEN_STAT_BYTES_IN, ret);
+        size = offset + ret;
+        for (pos = 0; pos + PING_SIZE <= size; pos += PING_SIZE)
+            pen_assert2(strncmp(PING, buf + pos, PING_SIZE) == 0);
+
+        self->offset_ = size - pos;
+        memcpy(self->buf_, buf + pos, self->offset_);
+
+        total += pos / PING_SIZE * PONG_SIZE;
+        if ((size_t)ret < sizeof(buf) - offset)
+            break;
+    }
+
+    if (total > 0)
+        pen_stats_add(self->stats_, PEN_STAT_PINGS, total / PONG_SIZE);
+    self->pending_ += total;
+    if (self->pending_ > 0 && _flush_pongs(self) < 0) {
+        PEN_WARN("write error: %s", strerror(errno));
+        _on_close(eb);
+    }
 }
 
+PEN_LOOP_TIMED(_on_event)
+
 static pen_event_base_t *
 on_new_client(pen_event_t ev,
               pen_socket_t fd,
-              void *user PEN_UNUSED,
+              void *user,
               struct sockaddr_in *addr PEN_UNUSED)
 {
+    pen_worker_t *worker = user;
     pen_client_t *self = NULL;
 
-    self = pen_memory_pool_get(pool);
+    self = pen_memory_pool_get(worker->pool_);
     pen_assert2(self != NULL);
     self->eb_.fd_ = fd;
-    self->eb_.on_event_ = _on_event;
+    self->eb_.on_event_ = _on_event_timed;
+    self->pool_ = worker->pool_;
+    self->stats_ = worker->stats_;
+    self->ev_ = ev;
+    self->offset_ = 0;
+    self->pending_ = 0;
+    self->writing_ = false;
+    pen_stats_add(self->stats_, PEN_STAT_ACCEPTS, 1);
+    pen_stats_add(self->stats_, PEN_STAT_ACTIVE, 1);
 
     pen_assert2(pen_event_add_r(ev, (pen_event_base_t*)self));
 
     return &self->eb_;
 }
 
+static bool
+_keep_running(void *user PEN_UNUSED)
+{
+    return running;
+}
+
+#ifdef SO_REUSEPORT
 static void
-start_server(pen_event_t ev)
+_on_accept(pen_event_base_t *eb, uint16_t pe)
 {
-    int ret = 0;
+    pen_worker_t *worker = eb->user_;
+    struct sockaddr_in addr;
+    socklen_t len;
+    int fd;
 
-    do {
-        fflush(NULL);
-        ret = pen_event_wait(ev, -1);
-    } while (running && ret >= 0);
+    if (pe == PEN_EVENT_CLOSE)
+        return;
+
+    for (;;) {
+        len = sizeof(addr);
+        fd = accept4(eb->fd_, (struct sockaddr *)&addr, &len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            break;
+        on_new_client(worker->ev_, fd, worker, &addr);
+    }
+}
+
+PEN_LOOP_TIMED(_on_accept)
+
+static bool
+_init_acceptor(pen_worker_t *worker)
+{
+    pen_event_base_t *eb = &worker->acceptor_;
+    struct sockaddr_in addr;
+    int on = 1;
+
+    eb->fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (eb->fd_ < 0)
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (setsockopt(eb->fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(eb->fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        bind(eb->fd_, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(eb->fd_, 128) != 0) {
+        PEN_ERROR("unable to listen on port %u", port);
+        close(eb->fd_);
+        return false;
+    }
+
+    eb->on_event_ = _on_accept_timed;
+    eb->user_ = worker;
+    return pen_event_add_r(worker->ev_, eb);
+}
+
+static void *
+_worker_main(void *arg)
+{
+    pen_worker_t *worker = arg;
+    char name[32];
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    snprintf(name, sizeof(name), "pong #%u", worker->id_);
+    pen_loop_run(name, worker->ev_, 100, false, _keep_running, NULL);
+
+    return NULL;
+}
+#endif
+
+static void
+_init_worker(pen_worker_t *worker, pen_event_t ev, pen_stats_block_t *stats)
+{
+    worker->ev_ = ev;
+    worker->stats_ = stats;
+    worker->pool_ = PEN_MEMORY_POOL_INIT(pool_size, pen_client_t);
+    pen_assert2(worker->pool_ != NULL);
+
+    if (worker_num == 1) {
+        worker->listener_ = pen_listener_init(ev, NULL, port, 128,
+                                              on_new_client, worker);
+        pen_assert2(worker->listener_ != NULL);
+        return;
+    }
+#ifdef SO_REUSEPORT
+    pen_assert2(_init_acceptor(worker));
+#endif
+}
+
+static void
+_destroy_worker(pen_worker_t *worker)
+{
+    if (worker->listener_ != NULL)
+        pen_listener_destroy(worker->listener_);
+    else
+        close(worker->acceptor_.fd_);
+    pen_memory_pool_destroy(worker->pool_);
 }
 
 int
 main(int argc, char *argv[])
 {
     pen_event_t ev;
-    pen_listener_t listener;
+    pen_worker_t *workers;
+    pen_stats_t stats;
 
     _init_options(argc, argv);
+#ifndef SO_REUSEPORT
+    pen_assert2(worker_num == 1);
+#endif
+    pen_assert2(worker_num > 0);
 
-    pool = PEN_MEMORY_POOL_INIT(pool_size, pen_client_t);
-    pen_assert2(pool != NULL);
+    for (size_t i = 0; i + PONG_SIZE <= sizeof(pongs); i += PONG_SIZE)
+        memcpy(pongs + i, PONG, PONG_SIZE);
 
     ev = pen_event_init(128);
     pen_assert2(ev != NULL);
@@ -136,17 +374,49 @@ main(int argc, char *argv[])
     pen_assert2(pen_signal(SIGTERM, _on_signal));
     pen_assert2(pen_signal(SIGINT, _on_signal));
 
-    listener = pen_listener_init(ev, NULL, port, 128, on_new_client, NULL);
-    pen_assert2(listener != NULL);
+    stats = pen_stats_init("pen_pong", stat_descs, PEN_STAT_NUM, worker_num);
+    pen_assert2(stats != NULL);
+    pen_assert2(pen_stats_start(stats, ev, stats_port, stats_dump));
+
+    workers = calloc(worker_num, sizeof(pen_worker_t));
+    pen_assert2(workers != NULL);
+
+    if (worker_num == 1) {
+        _init_worker(&workers[0], ev, pen_stats_block(stats, 0));
+        pen_assert2(pen_stats_watch(stats, 0, ev));
+    } else {
+        for (uint16_t i = 0; i < worker_num; i++) {
+            pen_event_t wev = pen_event_init(128);
+            pen_assert2(wev != NULL);
+            workers[i].id_ = i;
+            _init_worker(&workers[i], wev, pen_stats_block(stats, i));
+            pen_assert2(pen_stats_watch(stats, i, wev));
+        }
+#ifdef SO_REUSEPORT
+        for (uint16_t i = 0; i < worker_num; i++)
+            pen_assert2(pthread_create(&workers[i].thread_, NULL,
+                        _worker_main, &workers[i]) == 0);
+#endif
+    }
+
+    pen_loop_run("pong", ev, -1, true, _keep_running, NULL);
+
+#ifdef SO_REUSEPORT
+    for (uint16_t i = 0; worker_num > 1 && i < worker_num; i++)
+        pthread_join(workers[i].thread_, NULL);
+#endif
+    /* its lag timers live on the worker loops */
+    pen_stats_destroy(stats);
+    for (uint16_t i = 0; i < worker_num; i++) {
+        _destroy_worker(&workers[i]);
+        if (workers[i].ev_ != ev)
+            pen_event_destroy(workers[i].ev_);
+    }
+    free(workers);
 
-    start_server(ev);
-
-    pen_listener_destroy(listener);
     pen_signal_destroy();
     pen_event_destroy(ev);
-    pen_memory_pool_destroy(pool);
     puts("exit.");
 
     return 0;
 }
-
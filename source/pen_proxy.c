@@ -0,0 +1,515 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <pen_socket/pen_event.h>
+#include <pen_socket/pen_socket.h>
+#include <pen_socket/pen_listener.h>
+#include <pen_socket/pen_signal.h>
+#include <pen_socket/pen_timer.h>
+#include <pen_utils/pen_options.h>
+#include <pen_utils/pen_memory_pool.h>
+#include <pen_test/pen_speed.h>
+
+#include "pen_loop.h"
+
+#define PEN_HEAD_SIZE 2048
+#define PEN_PIPE_CACHE 256
+
+#define PEN_REPLY_OK "HTTP/1.1 200 Connection established\r\n\r\n"
+#define PEN_REPLY_BAD "HTTP/1.1 400 Bad Request\r\n\r\n"
+#define PEN_REPLY_FAIL "HTTP/1.1 502 Bad Gateway\r\n\r\n"
+
+typedef enum {
+    PEN_TUNNEL_HEAD,
+    PEN_TUNNEL_CONNECTING,
+    PEN_TUNNEL_RELAY,
+} pen_tunnel_phase_t;
+
+struct pen_tunnel_s;
+
+typedef struct pen_side_s {
+    pen_event_base_t eb_;
+    struct pen_tunnel_s *tunnel_;
+    struct pen_side_s *peer_;
+    /* what was read from this side and still waits for the peer */
+    int pipe_[2];
+    size_t queued_;
+    uint16_t watch_;
+    bool eof_;
+    bool shut_;
+} pen_side_t;
+
+typedef struct pen_tunnel_s {
+    pen_side_t client_;
+    pen_side_t upstream_;
+    pen_event_t ev_;
+    struct pen_tunnel_s *next_closed_;
+    pen_tunnel_phase_t phase_;
+    bool closed_;
+    uint32_t len_;
+    uint32_t used_;
+    char head_[PEN_HEAD_SIZE];
+} pen_tunnel_t;
+
+static bool running = true;
+static uint16_t port = 8124;
+static uint16_t budget = 16;
+static uint32_t pipe_size = 65536;
+static pen_memory_pool_t pool = NULL;
+static int pipe_cache[PEN_PIPE_CACHE][2];
+static uint16_t pipe_cached = 0;
+static uint32_t tunnels = 0;
+static pen_tunnel_t *closed = NULL;
+static pen_speed_t speeder;
+
+static inline void
+_init_options(int argc, char *argv[])
+{
+#define _i(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT16, d},
+#define _li(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT32, d},
+
+    pen_option_t opts[] = {
+        _i(--port, port, "port(default 8124)")
+        _li(--pipe-size, pipe_size, "pipe size per direction and tunnel(default 65536)")
+        _i(--budget, budget, "splices per side and wakeup(default 16)")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
+    };
+
+    PEN_OPTIONS_INIT(argc, argv, opts);
+#undef _i
+#undef _li
+}
+
+static void
+_on_signal(int sig PEN_UNUSED)
+{
+    fflush(NULL);
+    running = false;
+}
+
+/* creating pipes costs two fds and a syscall, drained ones are kept */
+static bool
+_pipe_get(int fds[2])
+{
+    if (pipe_cached > 0) {
+        pipe_cached--;
+        fds[0] = pipe_cache[pipe_cached][0];
+        fds[1] = pipe_cache[pipe_cached][1];
+        return true;
+    }
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0)
+        return false;
+    fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+    return true;
+}
+
+static void
+_pipe_put(int fds[2], size_t queued)
+{
+    if (fds[0] == -1)
+        return;
+    if (queued == 0 && pipe_cached < PEN_PIPE_CACHE) {
+        pipe_cache[pipe_cached][0] = fds[0];
+        pipe_cache[pipe_cached][1] = fds[1];
+        pipe_cached++;
+    } else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    fds[0] = fds[1] = -1;
+}
+static void
+_close_side(pen_tunnel_t *tunnel, pen_side_t *self)
+{
+    if (self->watch_ != 0)
+        pen_event_del(tunnel->ev_, &self->eb_);
+    if (self->eb_.fd_ != PEN_INVALID_SOCK)
+        close(self->eb_.fd_);
+    self->eb_.fd_ = PEN_INVALID_SOCK;
+    _pipe_put(self->pipe_, self->queued_);
+}
+
+/*
+ * The same wakeup may still hold an event of the other side, the tunnel
+ * goes back to the pool once the whole batch was handled.
+ */
+static void
+_close_tunnel(pen_tunnel_t *self)
+{
+    _close_side(self, &self->client_);
+    _close_side(self, &self->upstream_);
+    tunnels--;
+    self->closed_ = true;
+    self->next_closed_ = closed;
+    closed = self;
+}
+
+static void
+_free_closed(void)
+{
+    pen_tunnel_t *next;
+
+    for (; closed != NULL; closed = next) {
+        next = closed->next_closed_;
+        pen_memory_pool_put(pool, closed);
+    }
+}
+
+/* register exactly the events the side can make progress on */
+static void
+_watch(pen_tunnel_t *tunnel, pen_side_t *self, uint16_t watch)
+{
+    if (watch == self->watch_)
+        return;
+
+    if (watch == 0)
+        pen_event_del(tunnel->ev_, &self->eb_);
+    else if (self->watch_ == 0 && watch == PEN_EVENT_READ)
+        pen_assert2(pen_event_add_r(tunnel->ev_, &self->eb_));
+    else if (self->watch_ == 0 && watch == PEN_EVENT_WRITE)
+        pen_assert2(pen_event_add_w(tunnel->ev_, &self->eb_));
+    else if (self->watch_ == 0)
+        pen_assert2(pen_event_add_rw(tunnel->ev_, &self->eb_));
+    else if (watch == PEN_EVENT_READ)
+        pen_assert2(pen_event_mod_r(tunnel->ev_, &self->eb_));
+    else if (watch == PEN_EVENT_WRITE)
+        pen_assert2(pen_event_mod_w(tunnel->ev_, &self->eb_));
+    else
+        pen_assert2(pen_event_mod_rw(tunnel->ev_, &self->eb_));
+    self->watch_ = watch;
+}
+
+/*
+ * A side is only read while its pipe is empty, a slow peer so pushes back
+ * all the way to the sender instead of growing anything here.
+ */
+static void
+_update(pen_tunnel_t *self)
+{
+    pen_side_t *sides[2] = {&self->client_, &self->upstream_};
+    uint16_t watch;
+
+    for (int i = 0; i < 2; i++) {
+        watch = 0;
+        if (!sides[i]->eof_ && sides[i]->queued_ == 0)
+            watch |= PEN_EVENT_READ;
+        if (sides[i]->peer_->queued_ > 0)
+            watch |= PEN_EVENT_WRITE;
+        _watch(self, sides[i], watch);
+    }
+}
+
+/* move queued data of self to its peer, returns < 0 on error */
+static int
+_flush(pen_side_t *self)
+{
+    ssize_t ret;
+
+    while (self->queued_ > 0) {
+        ret = splice(self->pipe_[0], NULL, self->peer_->eb_.fd_, NULL,
+                     self->queued_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret < 0 && errno == EAGAIN)
+            return 0;
+        if (ret <= 0)
+            return -1;
+        self->queued_ -= ret;
+        pen_speed_add(&speeder, ret);
+    }
+
+    if (self->eof_ && !self->shut_) {
+        shutdown(self->peer_->eb_.fd_, SHUT_WR);
+        self->shut_ = true;
+    }
+    return 0;
+}
+
+static int
+_pump(pen_side_t *self)
+{
+    ssize_t ret = 0;
+
+    /* not read until the peer took the queued data, this is no eof */
+    if (self->queued_ > 0)
+        return 0;
+
+    for (uint16_t i = 0; i < budget && self->queued_ == 0; i++) {
+        ret = splice(self->eb_.fd_, NULL, self->pipe_[1], NULL, pipe_size,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret <= 0)
+            break;
+        self->queued_ = ret;
+        if (_flush(self) < 0)
+            return -1;
+    }
+
+    if (ret == 0) {
+        self->eof_ = true;
+        return _flush(self);
+    }
+    if (ret < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+static void
+_reply(pen_tunnel_t *self, const char *reply, size_t size)
+{
+    if (send(self->client_.eb_.fd_, reply, size, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)size)
+        PEN_WARN("reply to client failed: %s", strerror(errno));
+}
+
+#define _reply_const(self, r) _reply(self, r, sizeof(r) - 1)
+
+static void
+_on_connected(pen_tunnel_t *self)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    uint32_t early = self->len_ - self->used_;
+
+    getsockopt(self->upstream_.eb_.fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        PEN_WARN("connect upstream failed: %s", strerror(err));
+        _reply_const(self, PEN_REPLY_FAIL);
+        return _close_tunnel(self);
+    }
+
+    /* the client may have sent tunnel data right behind its request */
+    if (early > 0 && send(self->upstream_.eb_.fd_, self->head_ + self->used_,
+                          early, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)early) {
+        PEN_WARN("forward early data failed");
+        return _close_tunnel(self);
+    }
+
+    if (!_pipe_get(self->client_.pipe_) || !_pipe_get(self->upstream_.pipe_)) {
+        PEN_WARN("create pipe failed: %s", strerror(errno));
+        _reply_const(self, PEN_REPLY_FAIL);
+        return _close_tunnel(self);
+    }
+
+    _reply_const(self, PEN_REPLY_OK);
+    self->phase_ = PEN_TUNNEL_RELAY;
+    _update(self);
+}
+
+/* CONNECT host:port HTTP/1.x, everything else of the head is ignored */
+static bool
+_parse_head(pen_tunnel_t *self, char *host, size_t host_size, uint16_t *dest)
+{
+    static const char method[] = "CONNECT ";
+    char *target, *end, *colon;
+    long value;
+
+    if (self->used_ < sizeof(method) || memcmp(self->head_, method, sizeof(method) - 1) != 0)
+        return false;
+
+    target = self->head_ + sizeof(method) - 1;
+    end = memchr(target, ' ', self->used_ - (sizeof(method) - 1));
+    if (end == NULL)
+        return false;
+    colon = memrchr(target, ':', end - target);
+    if (colon == NULL || (size_t)(colon - target) >= host_size || colon == target)
+        return false;
+
+    value = strtol(colon + 1, NULL, 10);
+    if (value <= 0 || value > 65535)
+        return false;
+    memcpy(host, target, colon - target);
+    host[colon - target] = '\0';
+    *dest = value;
+    return true;
+}
+
+static void
+_read_head(pen_tunnel_t *self)
+{
+    char host[256];
+    uint16_t dest;
+    ssize_t ret;
+    char *end;
+
+    ret = recv(self->client_.eb_.fd_, self->head_ + self->len_,
+               sizeof(self->head_) - self->len_, MSG_DONTWAIT);
+    if (ret < 0 && errno == EAGAIN)
+        return;
+    if (ret <= 0)
+        return _close_tunnel(self);
+
+    self->len_ += ret;
+    end = memmem(self->head_, self->len_, "\r\n\r\n", 4);
+    if (end == NULL) {
+        if (self->len_ < sizeof(self->head_))
+            return;
+        _reply_const(self, PEN_REPLY_BAD);
+        return _close_tunnel(self);
+    }
+
+    self->used_ = end + 4 - self->head_;
+    if (!_parse_head(self, host, sizeof(host), &dest)) {
+        _reply_const(self, PEN_REPLY_BAD);
+        return _close_tunnel(self);
+    }
+
+    /* name lookups block the loop, benchmarks should use addresses */
+    if (!pen_connect_tcp(&self->upstream_.eb_, host, dest)) {
+        _reply_const(self, PEN_REPLY_FAIL);
+        return _close_tunnel(self);
+    }
+
+    self->phase_ = PEN_TUNNEL_CONNECTING;
+    _watch(self, &self->client_, 0);
+    _watch(self, &self->upstream_, PEN_EVENT_WRITE);
+}
+
+static void
+_on_event(pen_event_base_t *eb, uint16_t pe)
+{
+    pen_side_t *side = (pen_side_t *)eb;
+    pen_tunnel_t *self = side->tunnel_;
+
+    if (self->closed_)
+        return;
+    if (pe == PEN_EVENT_CLOSE) {
+        if (self->phase_ == PEN_TUNNEL_CONNECTING && side == &self->upstream_)
+            _reply_const(self, PEN_REPLY_FAIL);
+        return _close_tunnel(self);
+    }
+
+    switch (self->phase_) {
+    case PEN_TUNNEL_HEAD:
+        return _read_head(self);
+    case PEN_TUNNEL_CONNECTING:
+        return _on_connected(self);
+    default:
+        break;
+    }
+
+    if ((pe & PEN_EVENT_WRITE) && _flush(side->peer_) < 0)
+        return _close_tunnel(self);
+    if ((pe & PEN_EVENT_READ) && _pump(side) < 0)
+        return _close_tunnel(self);
+
+    if (self->client_.shut_ && self->upstream_.shut_)
+        return _close_tunnel(self);
+    _update(self);
+}
+
+PEN_LOOP_TIMED(_on_event)
+
+static void
+_init_side(pen_tunnel_t *tunnel, pen_side_t *self, pen_side_t *peer)
+{
+    self->eb_.fd_ = PEN_INVALID_SOCK;
+    self->eb_.on_event_ = _on_event_timed;
+    self->tunnel_ = tunnel;
+    self->peer_ = peer;
+    self->pipe_[0] = self->pipe_[1] = -1;
+}
+
+static pen_event_base_t *
+on_new_client(pen_event_t ev,
+              pen_socket_t fd,
+              void *user PEN_UNUSED,
+              struct sockaddr_in *addr PEN_UNUSED)
+{
+    pen_tunnel_t *self = NULL;
+
+    self = pen_memory_pool_get(pool);
+    pen_assert2(self != NULL);
+    /* the head buffer is only read up to len_, no need to clear it */
+    memset(self, 0, offsetof(pen_tunnel_t, head_));
+    self->ev_ = ev;
+    _init_side(self, &self->client_, &self->upstream_);
+    _init_side(self, &self->upstream_, &self->client_);
+    self->client_.eb_.fd_ = fd;
+    tunnels++;
+
+    _watch(self, &self->client_, PEN_EVENT_READ);
+
+    return &self->client_.eb_;
+}
+
+/* called after every wakeup */
+static bool
+_keep_running(void *user PEN_UNUSED)
+{
+    _free_closed();
+    return running;
+}
+
+static void
+_on_timer(void *arg PEN_UNUSED)
+{
+    pen_speed_current(&speeder);
+    PEN_INFO("%u tunnels open, %u pipe pairs cached", tunnels, pipe_cached);
+}
+
+int
+main(int argc, char *argv[])
+{
+    pen_listener_t listener;
+    pen_event_t ev;
+    pen_event_base_t *timer;
+
+    _init_options(argc, argv);
+    pen_assert2(budget > 0 && pipe_size > 0);
+
+    pool = PEN_MEMORY_POOL_INIT(16, pen_tunnel_t);
+    pen_assert2(pool != NULL);
+
+    ev = pen_event_init(16);
+    pen_assert2(ev != NULL);
+
+    pen_assert2(pen_signal_init(ev));
+    pen_assert2(pen_signal(SIGTERM, _on_signal));
+    pen_assert2(pen_signal(SIGINT, _on_signal));
+
+    listener = pen_listener_init(ev, NULL, port, 128, on_new_client, NULL);
+    pen_assert2(listener != NULL);
+
+    timer = pen_timer_init(ev, _on_timer, NULL);
+    pen_assert2(timer != NULL);
+    pen_timer_settime(timer, 10000);
+    pen_speed_init(&speeder, "proxy bytes");
+
+    pen_loop_run("proxy", ev, -1, false, _keep_running, NULL);
+
+    pen_speed_end(&speeder);
+    pen_timer_destroy(timer);
+    while (pipe_cached > 0) {
+        pipe_cached--;
+        close(pipe_cache[pipe_cached][0]);
+        close(pipe_cache[pipe_cached][1]);
+    }
+    pen_listener_destroy(listener);
+    pen_signal_destroy();
+    pen_event_destroy(ev);
+    pen_memory_pool_destroy(pool);
+    puts("exit.");
+
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <pen_socket/pen_socket.h>
+
+#include "pen_runner.h"
+
+#define PEN_RUNNER_SLOTS 8
+#define PEN_RUNNER_POLL_US 100
+
+typedef enum {
+    PEN_RUNNER_WAIT,
+    PEN_RUNNER_GO,
+    PEN_RUNNER_ABORT,
+} pen_runner_state_t;
+
+/* single producer, single consumer, both sides on their own cache line */
+typedef struct {
+    uint64_t head_ __attribute__((aligned(64)));
+    uint64_t tail_ __attribute__((aligned(64)));
+    pen_runner_sample_t slots_[PEN_RUNNER_SLOTS];
+} pen_runner_ring_t;
+
+typedef struct {
+    /* the start line, a worker dying before it must not block the rest */
+    uint32_t arrived_;
+    uint32_t state_;
+    pen_runner_ring_t rings_[];
+} pen_runner_shm_t;
+
+struct pen_runner_s {
+    pen_runner_shm_t *shm_;
+    size_t size_;
+    pid_t *pids_;
+    pid_t parent_;
+    uint16_t procs_;
+    uint16_t alive_;
+};
+
+pen_runner_t
+pen_runner_init(uint16_t procs)
+{
+    pen_runner_t self;
+
+    if (procs == 0)
+        return NULL;
+    self = calloc(1, sizeof(*self));
+    if (self == NULL)
+        return NULL;
+    self->procs_ = procs;
+    self->pids_ = calloc(procs, sizeof(pid_t));
+    if (self->pids_ == NULL)
+        goto error;
+
+    /* anonymous shared memory survives fork and needs no name to clean up */
+    self->size_ = sizeof(pen_runner_shm_t) + procs * sizeof(pen_runner_ring_t);
+    self->shm_ = mmap(NULL, self->size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (self->shm_ == MAP_FAILED)
+        goto error;
+    return self;
+
+error:
+    free(self->pids_);
+    free(self);
+    return NULL;
+}
+
+int
+pen_runner_fork(pen_runner_t self)
+{
+    pid_t pid;
+
+    fflush(NULL);
+    self->parent_ = getpid();
+    for (uint16_t i = 0; i < self->procs_; i++) {
+        pid = fork();
+        if (pid == 0)
+            return i;
+        if (pid < 0) {
+            PEN_ERROR("fork worker #%u failed: %s", i, strerror(errno));
+            /* whoever got started waits for a start that never comes */
+            __atomic_store_n(&self->shm_->state_, PEN_RUNNER_ABORT, __ATOMIC_RELEASE);
+            pen_runner_kill(self, SIGKILL);
+            return -1;
+        }
+        self->pids_[i] = pid;
+        self->alive_++;
+    }
+    return self->procs_;
+}
+
+static bool
+_worker_start(pen_runner_t self)
+{
+    uint32_t state;
+
+    __atomic_add_fetch(&self->shm_->arrived_, 1, __ATOMIC_RELEASE);
+    while ((state = __atomic_load_n(&self->shm_->state_, __ATOMIC_ACQUIRE)) == PEN_RUNNER_WAIT) {
+        /* reparented, the runner is gone */
+        if (getppid() != self->parent_)
+            return false;
+        usleep(PEN_RUNNER_POLL_US);
+    }
+    return state == PEN_RUNNER_GO;
+}
+
+bool
+pen_runner_start(pen_runner_t self)
+{
+    int status;
+
+    if (getpid() != self->parent_)
+        return _worker_start(self);
+
+    while (__atomic_load_n(&self->shm_->arrived_, __ATOMIC_ACQUIRE) < self->procs_) {
+        for (uint16_t i = 0; i < self->procs_; i++) {
+            if (self->pids_[i] <= 0 || waitpid(self->pids_[i], &status, WNOHANG) != self->pids_[i])
+                continue;
+            PEN_ERROR("worker #%u exited before the start(%d), aborting", i, status);
+            self->pids_[i] = 0;
+            self->alive_--;
+            __atomic_store_n(&self->shm_->state_, PEN_RUNNER_ABORT, __ATOMIC_RELEASE);
+            pen_runner_kill(self, SIGKILL);
+            return false;
+        }
+        usleep(PEN_RUNNER_POLL_US);
+    }
+    __atomic_store_n(&self->shm_->state_, PEN_RUNNER_GO, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool
+pen_runner_push(pen_runner_t self, uint16_t id, const pen_runner_sample_t *sample)
+{
+    pen_runner_ring_t *ring = &self->shm_->rings_[id];
+    uint64_t head = ring->head_;
+
+    if (head - __atomic_load_n(&ring->tail_, __ATOMIC_ACQUIRE) == PEN_RUNNER_SLOTS)
+        return false;
+    memcpy(&ring->slots_[head % PEN_RUNNER_SLOTS], sample, sizeof(*sample));
+    __atomic_store_n(&ring->head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint32_t
+pen_runner_drain(pen_runner_t self, pen_runner_sample_t *sum)
+{
+    pen_runner_ring_t *ring;
+    uint64_t head, tail;
+    uint32_t num = 0;
+
+    for (uint16_t i = 0; i < self->procs_; i++) {
+        ring = &self->shm_->rings_[i];
+        head = __atomic_load_n(&ring->head_, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail_; tail != head; tail++, num++)
+            pen_runner_merge(sum, &ring->slots_[tail % PEN_RUNNER_SLOTS]);
+        __atomic_store_n(&ring->tail_, tail, __ATOMIC_RELEASE);
+    }
+    return num;
+}
+
+uint16_t
+pen_runner_reap(pen_runner_t self)
+{
+    int status;
+
+    for (uint16_t i = 0; i < self->procs_; i++) {
+        if (self->pids_[i] <= 0 || waitpid(self->pids_[i], &status, WNOHANG) != self->pids_[i])
+            continue;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            PEN_WARN("worker #%u exited abnormally(%d)", i, status);
+        self->pids_[i] = 0;
+        self->alive_--;
+    }
+    return self->alive_;
+}
+
+void
+pen_runner_kill(pen_runner_t self, int sig)
+{
+    for (uint16_t i = 0; i < self->procs_; i++) {
+        if (self->pids_[i] > 0)
+            kill(self->pids_[i], sig);
+    }
+}
+
+void
+pen_runner_destroy(pen_runner_t self)
+{
+    for (uint16_t i = 0; i < self->procs_; i++) {
+        if (self->pids_[i] > 0)
+            waitpid(self->pids_[i], NULL, 0);
+    }
+    munmap(self->shm_, self->size_);
+    free(self->pids_);
+    free(self);
+}
+
+void
+pen_runner_merge(pen_runner_sample_t *self, const pen_runner_sample_t *other)
+{
+    self->done_ += other->done_;
+    self->failed_ += other->failed_;
+    pen_histogram_merge(&self->latency_, &other->latency_);
+    pen_histogram_merge(&self->connect_, &other->connect_);
+}
+
+void
+pen_runner_reset(pen_runner_sample_t *self)
+{
+    self->done_ = 0;
+    self->failed_ = 0;
+    pen_histogram_reset(&self->latency_);
+    pen_histogram_reset(&self->connect_);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_RUNNER_H
+#define PEN_RUNNER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pen_histogram.h"
+
+/* what a worker process reports per interval, merged by the runner */
+typedef struct {
+    uint64_t done_;
+    uint64_t failed_;
+    pen_histogram_t latency_;
+    pen_histogram_t connect_;
+} pen_runner_sample_t;
+
+typedef struct pen_runner_s *pen_runner_t;
+
+pen_runner_t pen_runner_init(uint16_t procs);
+/* returns the worker id in the children, procs in the runner and -1 on error */
+int pen_runner_fork(pen_runner_t self);
+/*
+ * The runner and every worker wait here until all of them arrived. False
+ * when a worker died before that, the runner then kills the others and
+ * the waiting workers return too.
+ */
+bool pen_runner_start(pen_runner_t self);
+/* false while the ring of `id` is full, the caller keeps the sample */
+bool pen_runner_push(pen_runner_t self, uint16_t id, const pen_runner_sample_t *sample);
+/* merges everything queued by all workers into `sum`, returns the samples taken */
+uint32_t pen_runner_drain(pen_runner_t self, pen_runner_sample_t *sum);
+/* returns the number of workers still running */
+uint16_t pen_runner_reap(pen_runner_t self);
+void pen_runner_kill(pen_runner_t self, int sig);
+void pen_runner_destroy(pen_runner_t self);
+
+void pen_runner_merge(pen_runner_sample_t *self, const pen_runner_sample_t *other);
+void pen_runner_reset(pen_runner_sample_t *self);
+
+#endif /* PEN_RUNNER_H */
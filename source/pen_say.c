@@ -16,36 +16,106 @@
  */
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <pen_utils/pen_options.h>
 #include <pen_socket/pen_event.h>
 #include <pen_socket/pen_signal.h>
 #include <pen_socket/pen_socket.h>
+#include <pen_socket/pen_timer.h>
 
-#define DATA \
-    "CONNECT registry-1.docker.io:443 HTTP/1.1\r\n" \
-    "Host: registry-1.docker.io:443\r\n" \
-    "User-Agent: Go-http-client/1.1\r\n\r\n"
-#define DATA_SIZE sizeof(DATA) - 1
+#include "pen_histogram.h"
+#include "pen_loop.h"
+
+#define PEN_REQUEST_SIZE 8192
+#define PEN_READ_SIZE 65536
+#define PEN_UA "User-Agent: Go-http-client/1.1"
+
+typedef enum {
+    PEN_SAY_CONNECTING,
+    PEN_SAY_REQUESTED,
+    PEN_SAY_TUNNEL,
+} pen_say_phase_t;
 
 bool running = true;
 static uint16_t port = 8124;
 static const char *host = "127.0.0.1";
+static const char *target = "registry-1.docker.io:443";
+static const char *header = NULL;
+static const char *header_file = NULL;
+static uint16_t conn_num = 1;
+static uint32_t repeat = 1;
+static uint32_t tunnel = 0;
+static uint32_t chunk = 16384;
+static uint16_t sink = 0;
+static uint16_t compare = 0;
+static bool direct = false;
+static char target_host[256];
+static uint16_t target_port = 0;
+static uint16_t alive = 0;
+static char request[PEN_REQUEST_SIZE];
+static size_t request_size = 0;
+static char *payload = NULL;
+static uint64_t ok_num = 0;
+static uint64_t err_num = 0;
+static uint64_t ok_total = 0;
+static uint64_t err_total = 0;
+static uint64_t tunnel_bytes = 0;
+static uint32_t seconds = 0;
+static pen_histogram_t connect_hist;
+static pen_histogram_t ttfb_hist;
+static pen_histogram_t rtt_hist;
+static double goodput_min;
+static double goodput_max;
+static double goodput_sum;
+static uint64_t goodput_num;
+
+/* just enough of a http response head to get the status */
+typedef struct {
+    uint8_t state_;
+    uint8_t pos_;
+    uint16_t status_;
+    uint32_t tail_;
+} pen_status_parser_t;
 
 typedef struct {
     pen_event_base_t eb_;
-    bool connected_;
+    pen_event_t ev_;
+    pen_say_phase_t phase_;
+    bool replied_;
+    uint32_t left_;
+    uint64_t start_;
+    uint64_t sent_;
+    pen_status_parser_t parser_;
+    /* tunnel bytes, the current chunk is [chunk_base_, chunk_end_) */
+    uint64_t pushed_;
+    uint64_t pulled_;
+    uint64_t chunk_base_;
+    uint64_t chunk_end_;
+    uint64_t chunk_start_;
+    uint64_t tunnel_start_;
 } pen_connector_t;
 
 static void _on_event(pen_event_base_t *, uint16_t);
+PEN_LOOP_TIMED(_on_event)
 
 static void
 create_connector(pen_event_t ev, pen_connector_t *self)
 {
-    pen_assert2(pen_connect_tcp(&self->eb_, host, port));
+    uint32_t left = self->left_;
 
-    self->eb_.on_event_ = _on_event;
+    memset(self, 0, sizeof(*self));
+    self->ev_ = ev;
+    self->left_ = left;
+    self->start_ = pen_histogram_now();
+    if (direct)
+        pen_assert2(pen_connect_tcp(&self->eb_, target_host, target_port));
+    else
+        pen_assert2(pen_connect_tcp(&self->eb_, host, port));
+
+    self->eb_.on_event_ = _on_event_timed;
 
     pen_assert2(pen_event_add_rw(ev, (pen_event_base_t*)self));
 }
@@ -54,18 +124,115 @@ static inline void
 _init_options(int argc, char *argv[])
 {
 #define _i(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT16, d},
+#define _li(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_UINT32, d},
 #define _s(a,b,d) {#a, &b, sizeof(b), PEN_OPTION_STRING, d},
 
     pen_option_t opts[] = {
-        _i(--port, port, "port(default 1234)")
-        _s(--host, host, "remote host(default 127.0.0.1)")
+        _i(--port, port, "proxy port(default 8124)")
+        _s(--host, host, "proxy host(default 127.0.0.1)")
+        _s(--target, target, "host:port to CONNECT to(default registry-1.docker.io:443)")
+        _s(--header, header, "one extra request header(default " PEN_UA ")")
+        _s(--headers, header_file, "file with extra request headers, one per line(default NULL)")
+        _i(--conns, conn_num, "concurrent connections(default 1)")
+        _li(--repeat, repeat, "connections opened one after another per --conns slot(default 1)")
+        _li(--tunnel, tunnel, "bytes to push through each tunnel, 0 to only CONNECT(default 0)")
+        _li(--chunk, chunk, "tunnel bytes per round trip(default 16384)")
+        _i(--sink, sink, "the target drops the data instead of echoing it(default 0)")
+        _i(--compare, compare, "run directly against --target first as a baseline(default 0)")
+        _i(--profile-loop, pen_loop_profiling, "report event loop timings(default 0)")
     };
 
     PEN_OPTIONS_INIT(argc, argv, opts);
 #undef _i
+#undef _li
 #undef _s
 }
 
+static void
+_append_header(const char *line, size_t len)
+{
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+    if (len == 0)
+        return;
+    pen_assert2(request_size + len + 2 < sizeof(request));
+    memcpy(request + request_size, line, len);
+    memcpy(request + request_size + len, "\r\n", 2);
+    request_size += len + 2;
+}
+
+static void
+_init_request(void)
+{
+    char line[1024];
+    const char *colon;
+    FILE *fp;
+    int ret;
+
+    ret = snprintf(request, sizeof(request), "CONNECT %s HTTP/1.1\r\nHost: %s\r\n",
+                   target, target);
+    pen_assert2(ret > 0 && (size_t)ret < sizeof(request));
+    request_size = ret;
+
+    if (header == NULL && header_file == NULL)
+        header = PEN_UA;
+    if (header != NULL)
+        _append_header(header, strlen(header));
+    if (header_file != NULL) {
+        fp = fopen(header_file, "r");
+        pen_assert2(fp != NULL);
+        while (fgets(line, sizeof(line), fp) != NULL)
+            _append_header(line, strlen(line));
+        fclose(fp);
+    }
+    pen_assert2(request_size + 2 < sizeof(request));
+    memcpy(request + request_size, "\r\n", 2);
+    request_size += 2;
+
+    /* only needed to reach the target without the proxy */
+    colon = strrchr(target, ':');
+    pen_assert2(colon != NULL && (size_t)(colon - target) < sizeof(target_host));
+    memcpy(target_host, target, colon - target);
+    target_host[colon - target] = '\0';
+    target_port = atoi(colon + 1);
+}
+
+/* -1: not http, 0: need more, 1: the whole head arrived */
+static int
+_parse_status(pen_status_parser_t *self, const char *buf, size_t size)
+{
+    static const char version[] = "HTTP/1.";
+    char c;
+
+    for (size_t i = 0; i < size; i++) {
+        c = buf[i];
+        self->tail_ = self->tail_ << 8 | (uint8_t)c;
+        switch (self->state_) {
+        case 0:
+            if (self->pos_ < sizeof(version) - 1) {
+                if (c != version[self->pos_++])
+                    return -1;
+            } else if (c == ' ') {
+                self->state_ = 1;
+                self->pos_ = 0;
+            }
+            break;
+        case 1:
+            if (c < '0' || c > '9')
+                return -1;
+            self->status_ = self->status_ * 10 + (c - '0');
+            if (++self->pos_ == 3)
+                self->state_ = 2;
+            break;
+        default:
+            if (self->tail_ == 0x0d0a0d0a)
+                return 1;
+            break;
+        }
+    }
+    return 0;
+}
+
 static void
 _on_signal(int sig PEN_UNUSED)
 {
@@ -73,70 +240,272 @@ _on_signal(int sig PEN_UNUSED)
     running = false;
 }
 
+static bool
+_keep_running(void *user PEN_UNUSED)
+{
+    return running && alive > 0;
+}
+
+/* one request is over, start the next one on a fresh connection */
+static void
+_on_done(pen_connector_t *self, bool ok)
+{
+    if (ok)
+        ok_num++;
+    else
+        err_num++;
+
+    pen_event_del(self->ev_, &self->eb_);
+    close(self->eb_.fd_);
+    self->eb_.fd_ = PEN_INVALID_SOCK;
+
+    if (--self->left_ > 0 && running)
+        create_connector(self->ev_, self);
+    else
+        alive--;
+}
+
 static void
-start_server(pen_event_t ev)
+_next_chunk(pen_connector_t *self)
 {
-    int ret = 0;
+    uint64_t now = pen_histogram_now();
+
+    if (self->pushed_ == tunnel) {
+        double goodput = tunnel * 1e9 / (now - self->tunnel_start_);
+
+        if (goodput_num == 0 || goodput < goodput_min)
+            goodput_min = goodput;
+        if (goodput > goodput_max)
+            goodput_max = goodput;
+        goodput_sum += goodput;
+        goodput_num++;
+        return _on_done(self, true);
+    }
 
-    do {
-        fflush(NULL);
-        ret = pen_event_wait(ev, -1);
-    } while (running && ret >= 0);
+    self->chunk_base_ = self->pushed_;
+    self->chunk_end_ = self->pushed_ + chunk;
+    if (self->chunk_end_ > tunnel)
+        self->chunk_end_ = tunnel;
+    self->chunk_start_ = now;
+    pen_assert2(pen_event_mod_rw(self->ev_, &self->eb_));
 }
 
 static void
-_on_close(pen_event_base_t *eb)
+_start_tunnel(pen_connector_t *self)
 {
-    close(eb->fd_);
-    running = false;
+    if (tunnel == 0)
+        return _on_done(self, true);
+
+    self->phase_ = PEN_SAY_TUNNEL;
+    self->tunnel_start_ = pen_histogram_now();
+    _next_chunk(self);
 }
 
-static bool
-_on_write(pen_event_base_t *eb)
+static void
+_tunnel_write(pen_connector_t *self)
 {
-    pen_connector_t *self = (pen_connector_t *)eb;
-    if (self->connected_)
-        return true;
+    pen_event_base_t *eb = &self->eb_;
+    uint64_t off;
+    ssize_t ret;
+
+    while (self->pushed_ < self->chunk_end_) {
+        off = self->pushed_ - self->chunk_base_;
+        ret = send(eb->fd_, payload + off, self->chunk_end_ - self->pushed_,
+                   MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0 && errno == EAGAIN)
+            return;
+        if (ret <= 0) {
+            PEN_WARN("tunnel send failed: %s", strerror(errno));
+            return _on_done(self, false);
+        }
+        self->pushed_ += ret;
+        if (sink)
+            tunnel_bytes += ret;
+    }
 
-    PEN_DEBUG("connected.\n");
-    self->connected_ = true;
-    pen_assert2(write(eb->fd_, DATA, DATA_SIZE) == DATA_SIZE);
-    return true;
+    /* a sink never answers, the socket buffer taking the chunk is the round trip */
+    if (sink) {
+        pen_histogram_record(&rtt_hist, pen_histogram_now() - self->chunk_start_);
+        return _next_chunk(self);
+    }
+    pen_assert2(pen_event_mod_r(self->ev_, eb));
+}
+
+static void
+_tunnel_read(pen_connector_t *self, const char *buf, size_t size)
+{
+    if (sink || self->pulled_ + size > self->pushed_) {
+        PEN_WARN("unexpected %zu bytes from the tunnel", size);
+        return _on_done(self, false);
+    }
+    /* a chunk is only sent after the last one came back, so it is all in payload */
+    if (memcmp(buf, payload + (self->pulled_ - self->chunk_base_), size) != 0) {
+        PEN_WARN("tunnel echoed other bytes than sent at %llu",
+                 (unsigned long long)self->pulled_);
+        return _on_done(self, false);
+    }
+
+    self->pulled_ += size;
+    tunnel_bytes += size;
+    if (self->pulled_ < self->chunk_end_)
+        return;
+
+    pen_histogram_record(&rtt_hist, pen_histogram_now() - self->chunk_start_);
+    _next_chunk(self);
+}
+
+static void
+_on_write(pen_connector_t *self)
+{
+    pen_event_base_t *eb = &self->eb_;
+
+    if (self->phase_ == PEN_SAY_TUNNEL)
+        return _tunnel_write(self);
+    if (self->phase_ != PEN_SAY_CONNECTING)
+        return;
+
+    self->sent_ = pen_histogram_now();
+    pen_histogram_record(&connect_hist, self->sent_ - self->start_);
+    if (direct)
+        return _start_tunnel(self);
+
+    self->phase_ = PEN_SAY_REQUESTED;
+    if (send(eb->fd_, request, request_size, MSG_NOSIGNAL) != (ssize_t)request_size) {
+        PEN_WARN("send request failed: %s", strerror(errno));
+        return _on_done(self, false);
+    }
+    pen_assert2(pen_event_mod_r(self->ev_, eb));
 }
 
 static void
 _on_event(pen_event_base_t *eb, uint16_t pe)
 {
-    static char buf[10240];
+    pen_connector_t *self = (pen_connector_t *)eb;
+    static char buf[PEN_READ_SIZE];
+    uint32_t left = self->left_;
+    ssize_t ret;
+    int done;
 
     if (pe == PEN_EVENT_CLOSE)
-        return _on_close(eb);
+        return _on_done(self, false);
+
+    if (pe & PEN_EVENT_WRITE) {
+        _on_write(self);
+        /* the connector may have been closed or even recycled */
+        if (self->left_ != left || eb->fd_ == PEN_INVALID_SOCK)
+            return;
+    }
 
-    if (pe & PEN_EVENT_WRITE)
-        _on_write(eb);
+    if ((pe & PEN_EVENT_READ) == 0 || self->phase_ == PEN_SAY_CONNECTING)
+        return;
 
-    if ((pe & PEN_EVENT_READ) == 0)
+    ret = recv(eb->fd_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret < 0 && errno == EAGAIN)
         return;
+    if (ret <= 0)
+        return _on_done(self, false);
 
-    int ret = read(eb->fd_, buf, sizeof(buf) - 1);
+    if (self->phase_ == PEN_SAY_TUNNEL)
+        return _tunnel_read(self, buf, ret);
 
-    if (ret <= 0) {
-        PEN_WARN("read error!!!");
-        _on_close(eb);
+    if (!self->replied_) {
+        self->replied_ = true;
+        pen_histogram_record(&ttfb_hist, pen_histogram_now() - self->sent_);
+    }
+
+    done = _parse_status(&self->parser_, buf, ret);
+    if (done == 0)
         return;
+    if (done < 0 || self->parser_.status_ / 100 != 2)
+        return _on_done(self, false);
+    /* nothing was pushed yet, so anything after the head is not ours */
+    _start_tunnel(self);
+}
+
+static void
+_on_timer(void *arg PEN_UNUSED)
+{
+    printf("%us: ok %llu/s, error %llu/s, tunnel %.2fMB/s, alive %u\n", ++seconds,
+           (unsigned long long)ok_num, (unsigned long long)err_num,
+           tunnel_bytes / 1048576.0, alive);
+    ok_total += ok_num;
+    err_total += err_num;
+    ok_num = 0;
+    err_num = 0;
+    tunnel_bytes = 0;
+}
+
+static void
+_reset(void)
+{
+    ok_num = err_num = ok_total = err_total = 0;
+    tunnel_bytes = 0;
+    seconds = 0;
+    pen_histogram_reset(&connect_hist);
+    pen_histogram_reset(&ttfb_hist);
+    pen_histogram_reset(&rtt_hist);
+    goodput_min = goodput_max = goodput_sum = 0;
+    goodput_num = 0;
+}
+
+static void
+_run(pen_event_t ev, pen_event_base_t *timer, pen_connector_t *conns)
+{
+    const char *name = direct ? "direct" : "proxy";
+
+    _reset();
+    pen_timer_settime(timer, 1000);
+    for (uint16_t i = 0; i < conn_num; i++) {
+        conns[i].left_ = repeat;
+        create_connector(ev, &conns[i]);
+    }
+    alive = conn_num;
+
+    pen_loop_run("say", ev, -1, true, _keep_running, NULL);
+
+    _on_timer(NULL);
+    printf("%s total: ok %llu, error %llu\n", name,
+           (unsigned long long)ok_total, (unsigned long long)err_total);
+    pen_histogram_print(&connect_hist, "connect");
+    if (!direct)
+        pen_histogram_print(&ttfb_hist, "first byte");
+    if (tunnel == 0)
+        goto out;
+
+    pen_histogram_print(&rtt_hist, sink ? "chunk" : "round trip");
+    if (goodput_num > 0) {
+        printf("%s goodput per tunnel: min %.2fMB/s, avg %.2fMB/s, max %.2fMB/s\n",
+               name, goodput_min / 1048576.0,
+               goodput_sum / goodput_num / 1048576.0, goodput_max / 1048576.0);
     }
 
-    buf[ret] = '\0';
-    printf("%s\n", buf);
+out:
+    for (uint16_t i = 0; i < conn_num; i++) {
+        if (conns[i].eb_.fd_ == PEN_INVALID_SOCK)
+            continue;
+        pen_event_del(ev, &conns[i].eb_);
+        close(conns[i].eb_.fd_);
+        conns[i].eb_.fd_ = PEN_INVALID_SOCK;
+    }
 }
 
 int
 main(int argc, char *argv[])
 {
     pen_event_t ev;
-    pen_connector_t conns;
+    pen_event_base_t *timer;
+    pen_connector_t *conns;
+    uint64_t base50 = 0, base99 = 0;
 
     _init_options(argc, argv);
+    pen_assert2(conn_num > 0 && repeat > 0 && chunk > 0);
+    pen_assert2(!compare || tunnel > 0);
+    _init_request();
+
+    payload = malloc(chunk);
+    pen_assert2(payload != NULL);
+    for (uint32_t i = 0; i < chunk; i++)
+        payload[i] = 'a' + i % 26;
 
     ev = pen_event_init(16);
     pen_assert2(ev != NULL);
@@ -145,15 +514,33 @@ main(int argc, char *argv[])
     pen_assert2(pen_signal(SIGTERM, _on_signal));
     pen_assert2(pen_signal(SIGINT, _on_signal));
 
-    memset(&conns, 0, sizeof(conns));
-    create_connector(ev, &conns);
+    timer = pen_timer_init(ev, _on_timer, NULL);
+    pen_assert2(timer != NULL);
 
-    start_server(ev);
+    conns = calloc(conn_num, sizeof(pen_connector_t));
+    pen_assert2(conns != NULL);
 
+    if (compare) {
+        direct = true;
+        _run(ev, timer, conns);
+        base50 = pen_histogram_percentile(&rtt_hist, 50);
+        base99 = pen_histogram_percentile(&rtt_hist, 99);
+        direct = false;
+    }
+    if (running)
+        _run(ev, timer, conns);
+    if (compare && running) {
+        printf("proxy adds: p50 %.1fus, p99 %.1fus\n",
+               ((double)pen_histogram_percentile(&rtt_hist, 50) - base50) / 1000.0,
+               ((double)pen_histogram_percentile(&rtt_hist, 99) - base99) / 1000.0);
+    }
+
+    free(conns);
+    free(payload);
+    pen_timer_destroy(timer);
     pen_signal_destroy();
     pen_event_destroy(ev);
 
     puts("exit.");
     return 0;
 }
-
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pen_socket/pen_socket.h>
+
+#include "pen_state.h"
+
+#define PEN_STATE_MAGIC 0x3130415453454e50ULL /* "PENSTA01" */
+#define PEN_STATE_USED (1ULL << 32)
+#define PEN_STATE_MIN 1024
+
+typedef struct {
+    uint64_t magic_;
+    uint32_t capacity_;
+    uint32_t size_;
+} pen_state_head_t;
+
+typedef struct {
+    uint64_t key_;
+    uint32_t ip_;
+    uint32_t sum_;
+} pen_state_rec_t;
+
+struct pen_state_s {
+    char path_[PATH_MAX];
+    int fd_;
+    size_t bytes_;
+    pen_state_head_t *head_;
+    pen_state_rec_t *recs_;
+};
+
+static inline size_t
+_bytes(uint32_t capacity)
+{
+    return sizeof(pen_state_head_t) + (size_t)capacity * sizeof(pen_state_rec_t);
+}
+
+static inline uint32_t
+_hash(uint32_t id)
+{
+    id ^= id >> 16;
+    id *= 0x45d9f3b;
+    id ^= id >> 16;
+    return id;
+}
+
+static inline uint32_t
+_sum(uint32_t id, uint32_t ip)
+{
+    return _hash(id ^ _hash(ip ^ 0x5bd1e995));
+}
+
+/* NULL when a full (or corrupt) table neither has the id nor a free slot */
+static pen_state_rec_t *
+_slot(pen_state_t self, uint32_t id)
+{
+    uint32_t mask = self->head_->capacity_ - 1;
+    uint32_t i = _hash(id) & mask;
+    uint64_t key;
+
+    for (uint32_t n = 0; n <= mask; n++) {
+        key = __atomic_load_n(&self->recs_[i].key_, __ATOMIC_ACQUIRE);
+        if (key == 0 || key == (PEN_STATE_USED | id))
+            return &self->recs_[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void
+_unmap(pen_state_t self)
+{
+    if (self->head_ != NULL)
+        munmap(self->head_, self->bytes_);
+    if (self->fd_ >= 0)
+        close(self->fd_);
+    self->head_ = NULL;
+    self->fd_ = -1;
+}
+
+/* anything else than an empty file or our own is left alone */
+static bool
+_check(pen_state_t self, const char *path, const struct stat *st, uint32_t *capacity)
+{
+    pen_state_head_t head;
+
+    if ((size_t)st->st_size < sizeof(head)
+        || pread(self->fd_, &head, sizeof(head), 0) != sizeof(head)
+        || head.magic_ != PEN_STATE_MAGIC
+        || head.capacity_ < PEN_STATE_MIN || (head.capacity_ & (head.capacity_ - 1)) != 0
+        || (size_t)st->st_size != _bytes(head.capacity_)) {
+        PEN_ERROR("%s is not a state file, refuse to touch it.", path);
+        return false;
+    }
+    *capacity = head.capacity_;
+    return true;
+}
+
+static bool
+_map(pen_state_t self, const char *path, uint32_t capacity)
+{
+    struct stat st;
+    void *addr;
+    bool fresh = capacity > 0;
+
+    self->fd_ = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (self->fd_ < 0 || fstat(self->fd_, &st) != 0)
+        goto error;
+
+    if (!fresh && st.st_size == 0) {
+        fresh = true;
+        capacity = PEN_STATE_MIN;
+    } else if (!fresh && !_check(self, path, &st, &capacity)) {
+        _unmap(self);
+        return false;
+    }
+    if (fresh && (ftruncate(self->fd_, 0) != 0
+                  || ftruncate(self->fd_, _bytes(capacity)) != 0))
+        goto error;
+
+    self->bytes_ = _bytes(capacity);
+    addr = mmap(NULL, self->bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd_, 0);
+    if (addr == MAP_FAILED)
+        goto error;
+    self->head_ = addr;
+    self->recs_ = (pen_state_rec_t*)(self->head_ + 1);
+
+    if (fresh) {
+        self->head_->capacity_ = capacity;
+        self->head_->size_ = 0;
+        __atomic_store_n(&self->head_->magic_, PEN_STATE_MAGIC, __ATOMIC_RELEASE);
+    }
+    return true;
+error:
+    PEN_ERROR("map %s failed: %s", path, strerror(errno));
+    _unmap(self);
+    return false;
+}
+
+static bool
+_insert(pen_state_t self, uint32_t id, uint32_t ip)
+{
+    pen_state_rec_t *rec = _slot(self, id);
+
+    if (rec == NULL)
+        return false;
+    rec->ip_ = ip;
+    rec->sum_ = _sum(id, ip);
+    __atomic_store_n(&rec->key_, PEN_STATE_USED | id, __ATOMIC_RELEASE);
+    self->head_->size_++;
+    return true;
+}
+
+static bool
+_grow(pen_state_t self)
+{
+    struct pen_state_s bigger = {.fd_ = -1};
+    char tmp[PATH_MAX + 8];
+    pen_state_rec_t *rec;
+    uint32_t id;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", self->path_);
+    if (!_map(&bigger, tmp, self->head_->capacity_ * 2))
+        return false;
+
+    for (uint32_t i = 0; i < self->head_->capacity_; i++) {
+        rec = &self->recs_[i];
+        id = (uint32_t)rec->key_;
+        /* twice the room, every record fits */
+        if (rec->key_ != 0 && rec->sum_ == _sum(id, rec->ip_))
+            _insert(&bigger, id, rec->ip_);
+    }
+
+    if (msync(bigger.head_, bigger.bytes_, MS_SYNC) != 0
+        || rename(tmp, self->path_) != 0) {
+        PEN_ERROR("replace %s failed: %s", self->path_, strerror(errno));
+        _unmap(&bigger);
+        unlink(tmp);
+        return false;
+    }
+
+    _unmap(self);
+    strcpy(bigger.path_, self->path_);
+    *self = bigger;
+    return true;
+}
+
+pen_state_t
+pen_state_open(const char *path)
+{
+    pen_state_t self;
+
+    if (strlen(path) >= PATH_MAX)
+        return NULL;
+    self = calloc(1, sizeof(*self));
+    if (self == NULL)
+        return NULL;
+    self->fd_ = -1;
+    strcpy(self->path_, path);
+
+    if (!_map(self, path, 0)) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+bool
+pen_state_get(pen_state_t self, uint32_t id, uint32_t *ip)
+{
+    pen_state_rec_t *rec = _slot(self, id);
+
+    if (rec == NULL || rec->key_ == 0 || rec->sum_ != _sum(id, rec->ip_))
+        return false;
+    *ip = rec->ip_;
+    return true;
+}
+
+bool
+pen_state_set(pen_state_t self, uint32_t id, uint32_t ip)
+{
+    pen_state_rec_t *rec = _slot(self, id);
+
+    if (rec != NULL && rec->key_ != 0) {
+        rec->ip_ = ip;
+        rec->sum_ = _sum(id, ip);
+        return true;
+    }
+
+    /* a full table can only come from a size_ that lies, grow anyway */
+    if ((rec == NULL || (self->head_->size_ + 1) * 4 > self->head_->capacity_ * 3)
+        && !_grow(self))
+        return false;
+    return _insert(self, id, ip);
+}
+
+void
+pen_state_close(pen_state_t self)
+{
+    if (self->head_ != NULL)
+        msync(self->head_, self->bytes_, MS_SYNC);
+    _unmap(self);
+    free(self);
+}
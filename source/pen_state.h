@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_STATE_H
+#define PEN_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Persistent id -> ip table of pen_keepalive_server, an open addressing
+ * hash table living in an mmap'ed file. Lookups go straight to the mapping,
+ * so opening costs the same for any number of ids.
+ *
+ * A record becomes visible by its key, written last; an update that was cut
+ * in half fails its checksum and reads as unknown. Growing builds a new file
+ * next to the old one and renames it over, a crash keeps the old table.
+ * A path holding anything but an empty file or a table is refused.
+ */
+typedef struct pen_state_s *pen_state_t;
+
+pen_state_t pen_state_open(const char *path);
+bool pen_state_get(pen_state_t self, uint32_t id, uint32_t *ip);
+bool pen_state_set(pen_state_t self, uint32_t id, uint32_t ip);
+void pen_state_close(pen_state_t self);
+
+#endif /* PEN_STATE_H */
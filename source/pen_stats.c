@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pen_socket/pen_listener.h>
+#include <pen_socket/pen_socket.h>
+#include <pen_socket/pen_timer.h>
+
+#include "pen_histogram.h"
+#include "pen_stats.h"
+
+#define PEN_STATS_TICK 100
+#define PEN_STATS_TEXT 8192
+
+typedef struct {
+    pen_stats_block_t *block_;
+    pen_event_base_t *timer_;
+    uint64_t last_;
+} pen_stats_tick_t;
+
+struct pen_stats_s {
+    const char *prefix_;
+    const pen_stats_desc_t *descs_;
+    uint16_t num_;
+    uint16_t threads_;
+    bool enabled_;
+    pen_listener_t listener_;
+    pen_event_base_t *timer_;
+    pen_stats_block_t *blocks_;
+    pen_stats_tick_t *ticks_;
+};
+
+typedef struct {
+    pen_event_base_t eb_;
+    pen_stats_t stats_;
+} pen_stats_conn_t;
+
+pen_stats_t
+pen_stats_init(const char *prefix, const pen_stats_desc_t *descs,
+               uint16_t num, uint16_t threads)
+{
+    pen_stats_t self;
+
+    if (num > PEN_STATS_MAX || threads == 0)
+        return NULL;
+    self = calloc(1, sizeof(*self));
+    if (self == NULL)
+        return NULL;
+    self->blocks_ = aligned_alloc(64, threads * sizeof(pen_stats_block_t));
+    if (self->blocks_ == NULL) {
+        free(self);
+        return NULL;
+    }
+    memset(self->blocks_, 0, threads * sizeof(pen_stats_block_t));
+    self->ticks_ = calloc(threads, sizeof(pen_stats_tick_t));
+    if (self->ticks_ == NULL) {
+        free(self->blocks_);
+        free(self);
+        return NULL;
+    }
+    self->prefix_ = prefix;
+    self->descs_ = descs;
+    self->num_ = num;
+    self->threads_ = threads;
+    return self;
+}
+
+pen_stats_block_t *
+pen_stats_block(pen_stats_t self, uint16_t thread)
+{
+    return &self->blocks_[thread];
+}
+
+static uint64_t
+_sum(pen_stats_t self, uint16_t idx)
+{
+    uint64_t v = 0;
+
+    for (uint16_t i = 0; i < self->threads_; i++)
+        v += __atomic_load_n(&self->blocks_[i].v_[idx], __ATOMIC_RELAXED);
+    return v;
+}
+
+static size_t
+_format(pen_stats_t self, char *buf, size_t size)
+{
+    const pen_stats_desc_t *desc;
+    size_t len = 0;
+    int ret;
+
+#define _put(...) do { \
+    ret = snprintf(buf + len, size - len, __VA_ARGS__); \
+    if (ret < 0 || (size_t)ret >= size - len) \
+        return len; \
+    len += ret; \
+} while (0)
+
+    for (uint16_t i = 0; i < self->num_; i++) {
+        desc = &self->descs_[i];
+        _put("# HELP %s_%s %s\n# TYPE %s_%s %s\n%s_%s %lld\n",
+             self->prefix_, desc->name_, desc->help_,
+             self->prefix_, desc->name_, desc->gauge_ ? "gauge" : "counter",
+             self->prefix_, desc->name_, (long long)_sum(self, i));
+    }
+    _put("# HELP %s_loop_lag_us timer lateness of the event loop\n"
+         "# TYPE %s_loop_lag_us gauge\n", self->prefix_, self->prefix_);
+    for (uint16_t i = 0; i < self->threads_; i++) {
+        _put("%s_loop_lag_us{thread=\"%u\"} %llu\n", self->prefix_, i,
+             (unsigned long long)__atomic_load_n(&self->blocks_[i].lag_, __ATOMIC_RELAXED));
+    }
+    _put("# HELP %s_loop_lag_max_us worst timer lateness since start\n"
+         "# TYPE %s_loop_lag_max_us gauge\n", self->prefix_, self->prefix_);
+    for (uint16_t i = 0; i < self->threads_; i++) {
+        _put("%s_loop_lag_max_us{thread=\"%u\"} %llu\n", self->prefix_, i,
+             (unsigned long long)__atomic_load_n(&self->blocks_[i].lag_max_, __ATOMIC_RELAXED));
+    }
+#undef _put
+    return len;
+}
+
+static void
+_on_request(pen_event_base_t *eb, uint16_t pe)
+{
+    pen_stats_conn_t *self = (pen_stats_conn_t*)eb;
+    char buf[PEN_STATS_TEXT];
+    int head;
+    size_t len;
+
+    /* one scrape per connection, whatever was asked for */
+    if (pe != PEN_EVENT_CLOSE && recv(eb->fd_, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        head = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+        len = head + _format(self->stats_, buf + head, sizeof(buf) - head);
+        if (send(eb->fd_, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len)
+            PEN_WARN("stats response truncated");
+    }
+    close(eb->fd_);
+    free(self);
+}
+
+static pen_event_base_t *
+_on_scrape(pen_event_t ev, pen_socket_t fd, void *user,
+           struct sockaddr_in *addr PEN_UNUSED)
+{
+    pen_stats_conn_t *self = calloc(1, sizeof(*self));
+
+    pen_assert2(self != NULL);
+    self->eb_.fd_ = fd;
+    self->eb_.on_event_ = _on_request;
+    self->stats_ = user;
+
+    pen_assert2(pen_event_add_r(ev, &self->eb_));
+    return &self->eb_;
+}
+
+/* runs on the loop it measures, so only that thread writes its block */
+static void
+_on_tick(void *user)
+{
+    pen_stats_tick_t *tick = user;
+    pen_stats_block_t *block = tick->block_;
+    uint64_t now = pen_histogram_now();
+    uint64_t late = (now - tick->last_) / 1000;
+    uint64_t lag = late > PEN_STATS_TICK * 1000 ? late - PEN_STATS_TICK * 1000 : 0;
+
+    __atomic_store_n(&block->lag_, lag, __ATOMIC_RELAXED);
+    if (lag > block->lag_max_)
+        __atomic_store_n(&block->lag_max_, lag, __ATOMIC_RELAXED);
+    tick->last_ = now;
+}
+
+static void
+_on_dump(void *user)
+{
+    char buf[PEN_STATS_TEXT];
+
+    _format(user, buf, sizeof(buf));
+    PEN_INFO("stats:\n%s", buf);
+}
+
+bool
+pen_stats_start(pen_stats_t self, pen_event_t ev, uint16_t port, uint16_t dump)
+{
+    self->enabled_ = port > 0 || dump > 0;
+    if (port > 0) {
+        self->listener_ = pen_listener_init(ev, NULL, port, 16, _on_scrape, self);
+        if (self->listener_ == NULL)
+            return false;
+    }
+
+    if (dump > 0) {
+        self->timer_ = pen_timer_init(ev, _on_dump, self);
+        if (self->timer_ == NULL)
+            return false;
+        pen_timer_settime(self->timer_, dump * 1000);
+    }
+    return true;
+}
+
+bool
+pen_stats_watch(pen_stats_t self, uint16_t thread, pen_event_t ev)
+{
+    pen_stats_tick_t *tick = &self->ticks_[thread];
+
+    if (!self->enabled_)
+        return true;
+    tick->block_ = &self->blocks_[thread];
+    tick->timer_ = pen_timer_init(ev, _on_tick, tick);
+    if (tick->timer_ == NULL)
+        return false;
+    tick->last_ = pen_histogram_now();
+    pen_timer_settime(tick->timer_, PEN_STATS_TICK);
+    return true;
+}
+
+/* the watched loops must still exist, their timers live there */
+void
+pen_stats_destroy(pen_stats_t self)
+{
+    for (uint16_t i = 0; i < self->threads_; i++) {
+        if (self->ticks_[i].timer_ != NULL)
+            pen_timer_destroy(self->ticks_[i].timer_);
+    }
+    free(self->ticks_);
+    if (self->timer_ != NULL)
+        pen_timer_destroy(self->timer_);
+    if (self->listener_ != NULL)
+        pen_listener_destroy(self->listener_);
+    free(self->blocks_);
+    free(self);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020  linas <linas@justforfun.cn>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PEN_STATS_H
+#define PEN_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pen_socket/pen_event.h>
+
+#define PEN_STATS_MAX 16
+
+/* one per thread, only its owner writes, so plain relaxed stores are enough */
+typedef struct {
+    uint64_t v_[PEN_STATS_MAX];
+    uint64_t lag_;
+    uint64_t lag_max_;
+} __attribute__((aligned(64))) pen_stats_block_t;
+
+typedef struct {
+    const char *name_;
+    const char *help_;
+    bool gauge_;
+} pen_stats_desc_t;
+
+typedef struct pen_stats_s *pen_stats_t;
+
+pen_stats_t pen_stats_init(const char *prefix, const pen_stats_desc_t *descs,
+                           uint16_t num, uint16_t threads);
+pen_stats_block_t *pen_stats_block(pen_stats_t self, uint16_t thread);
+/*
+ * Serves the Prometheus text format on `port` (0: no listener) and logs
+ * every `dump` seconds (0: never), both from `ev`. With neither there is
+ * nothing to report and pen_stats_watch() arms nothing either.
+ */
+bool pen_stats_start(pen_stats_t self, pen_event_t ev, uint16_t port, uint16_t dump);
+/* samples the lag of the loop `ev` that `thread` runs, from that loop */
+bool pen_stats_watch(pen_stats_t self, uint16_t thread, pen_event_t ev);
+void pen_stats_destroy(pen_stats_t self);
+
+static inline void
+pen_stats_add(pen_stats_block_t *block, uint16_t idx, uint64_t v)
+{
+    __atomic_store_n(&block->v_[idx], block->v_[idx] + v, __ATOMIC_RELAXED);
+}
+
+/* gauges wrap around and are printed signed */
+static inline void
+pen_stats_sub(pen_stats_block_t *block, uint16_t idx, uint64_t v)
+{
+    __atomic_store_n(&block->v_[idx], block->v_[idx] - v, __ATOMIC_RELAXED);
+}
+
+#endif /* PEN_STATS_H */